@@ -0,0 +1,86 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   instoverhead.cc
+ * @date   octobre 17, 2026
+ * @brief  Per-store cost of the storeinst range check, out-of-line vs inline
+ */
+
+#include "nvsl/clock.hh"
+#include "nvsl/utils.hh"
+#include "run.hh"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using namespace nvsl;
+
+constexpr size_t MAX_STORES = 100UL * 1000 * 1000;
+constexpr size_t ARR_ELEMS = 4096;
+
+/* Mirrors of the runtime's globals, kept separate so that the benchmark does
+   not need libstoreinst */
+static void *volatile mb_start_addr = (void *)0x10000000000;
+static void *volatile mb_end_addr = (void *)0x20000000000;
+static volatile bool mb_start_tracking = true;
+static size_t mb_hits = 0;
+
+/** @brief Runtime side of a hit, stands in for local_log.log_range() */
+__attribute__((noinline, cold)) static void mb_log_memory(void *ptr) {
+  mb_hits++;
+  asm volatile("" : : "r"(ptr) : "memory");
+}
+
+/** @brief Equivalent of checkMemory() the pass used to call for every store */
+__attribute__((noinline)) static void mb_check_memory(void *ptr) {
+  if (mb_start_tracking) {
+    if (mb_start_addr <= ptr and ptr < mb_end_addr) {
+      mb_log_memory(ptr);
+    }
+  }
+}
+
+/** @brief Equivalent of the range check the pass now emits inline */
+__attribute__((always_inline)) static inline void mb_inline_check(void *ptr) {
+  const bool hit = mb_start_tracking and mb_start_addr <= ptr and
+                   ptr < mb_end_addr;
+  if (hit) [[unlikely]] {
+    mb_log_memory(ptr);
+  }
+}
+
+template <typename F>
+static double mb_time_stores(uint64_t *arr, F check) {
+  Clock clk;
+  clk.reset();
+  clk.tick();
+  for (size_t i = 0; i < MAX_STORES; i++) {
+    uint64_t *dst = &arr[i % ARR_ELEMS];
+    check(dst);
+    *dst = i;
+    asm volatile("" : : : "memory");
+  }
+  clk.tock();
+
+  return clk.ns() / (double)MAX_STORES;
+}
+
+void mb_instoverhead() {
+  /* All the stores go to the (volatile) heap and miss the tracked range, the
+     common case for instrumented code */
+  std::vector<uint64_t> arr(ARR_ELEMS);
+
+  const double none = mb_time_stores(arr.data(), [](void *) {});
+  const double outline = mb_time_stores(arr.data(), mb_check_memory);
+  const double inlined = mb_time_stores(arr.data(), mb_inline_check);
+
+  NVSL_ASSERT(mb_hits == 0, "Benchmark stores should miss the tracked range");
+
+  std::cout << "variant, ns/store, overhead ns/store\n";
+  std::cout << "uninstrumented, " << none << ", 0\n";
+  std::cout << "out-of-line checkMemory, " << outline << ", " << outline - none
+            << "\n";
+  std::cout << "inline range check, " << inlined << ", " << inlined - none
+            << "\n";
+}
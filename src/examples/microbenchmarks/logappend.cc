@@ -0,0 +1,126 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   logappend.cc
+ * @date   octobre 17, 2026
+ * @brief  Log append cost, memcpy + clwb vs. non-temporal stores
+ */
+
+#include "ntstore.hh"
+#include "nvsl/clock.hh"
+#include "nvsl/constants.hh"
+#include "nvsl/pmemops.hh"
+#include "nvsl/utils.hh"
+#include "run.hh"
+
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+
+using namespace nvsl;
+
+constexpr size_t LA_APPENDS = 1000000;
+constexpr size_t LA_ENTRY_SZ_START = 8;    // Bytes of payload
+constexpr size_t LA_ENTRY_SZ_END = 4096;   // Bytes of payload
+constexpr size_t LA_HDR_SZ = 16;           // Address + size
+constexpr size_t LA_DRAIN_DST = 16;        // Appends between fences
+constexpr size_t LA_MMAP_SIZE = 1024UL * 1024 * 1024;
+
+/** @brief Append like Log::log_range(), flushing all but the partial line */
+static void la_append_clwb(PMemOpsClwb &pmemops, uint8_t *log, size_t &off,
+                           size_t &flushed, const void *src, size_t bytes) {
+  const uint64_t hdr[2] = {(uint64_t)src, bytes};
+  memcpy(log + off, hdr, LA_HDR_SZ);
+  memcpy(log + off + LA_HDR_SZ, src, bytes);
+  off += LA_HDR_SZ + bytes;
+
+  const size_t full_cls = off / 64 - flushed / 64;
+  if (full_cls != 0) {
+    pmemops.flush(log + flushed, full_cls * 64);
+    flushed += full_cls * 64;
+  }
+}
+
+/** @brief Append like Log::append_nt() */
+static void la_append_nt(PMemOpsClwb &pmemops, uint8_t *log, size_t &off,
+                         const void *src, size_t bytes) {
+  alignas(64) uint8_t head[LA_HDR_SZ + 64];
+  const uint64_t hdr[2] = {(uint64_t)src, bytes};
+  memcpy(head, hdr, LA_HDR_SZ);
+
+  const size_t staged =
+      std::min(bytes, (64 - (off + LA_HDR_SZ) % 64) % 64);
+  memcpy(head + LA_HDR_SZ, src, staged);
+
+  cxlbuf::stream_copy(log + off, head, LA_HDR_SZ + staged);
+  cxlbuf::stream_copy(log + off + LA_HDR_SZ + staged,
+                      (const uint8_t *)src + staged, bytes - staged);
+
+  const size_t entry_off = off;
+  off += LA_HDR_SZ + bytes;
+  if (entry_off / 64 != off / 64 and entry_off % 64 != 0) {
+    pmemops.flush(log + entry_off / 64 * 64, 64);
+  }
+}
+
+void mb_logappend() {
+  PMemOpsClwb pmemops;
+
+  int fd = open("/mnt/pmem0/microbench", O_CREAT | O_RDWR, 0666);
+  if (fd == -1) {
+    DBGE << "Unable to open the microbenchmark file" << std::endl;
+    DBGE << PSTR();
+    exit(1);
+  }
+
+  lseek(fd, LA_MMAP_SIZE + 1, SEEK_SET);
+  write(fd, 0, 1);
+  lseek(fd, 0, SEEK_SET);
+
+  auto log = (uint8_t *)mmap(nullptr, LA_MMAP_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+  if (log == MAP_FAILED) {
+    DBGE << "Unable to mmap the microbenchmark file" << std::endl;
+    DBGE << PSTR();
+    exit(1);
+  }
+  memset(log, 0, LA_MMAP_SIZE);
+
+  /* Source of the old values, stays cached like the data being updated */
+  static uint8_t src[LA_ENTRY_SZ_END];
+  memset(src, rand(), sizeof(src));
+
+  std::cout << "entry bytes, clwb ns/append, nt ns/append\n";
+
+  Clock clk;
+  for (size_t sz = LA_ENTRY_SZ_START; sz <= LA_ENTRY_SZ_END; sz *= 2) {
+    const size_t appends =
+        std::min(LA_APPENDS, LA_MMAP_SIZE / (LA_HDR_SZ + sz) - 1);
+    double ns[2];
+
+    for (int variant = 0; variant < 2; variant++) {
+      size_t off = 0, flushed = 0;
+
+      clk.reset();
+      clk.tick();
+      for (size_t i = 0; i < appends; i++) {
+        if (variant == 0) {
+          la_append_clwb(pmemops, log, off, flushed, src, sz);
+        } else {
+          la_append_nt(pmemops, log, off, src, sz);
+        }
+
+        if (i % LA_DRAIN_DST == 0) pmemops.drain();
+      }
+      pmemops.drain();
+      clk.tock();
+
+      ns[variant] = clk.ns() / (double)appends;
+    }
+
+    std::cout << sz << ", " << ns[0] << ", " << ns[1] << std::endl;
+  }
+
+  munmap(log, LA_MMAP_SIZE);
+  close(fd);
+}
@@ -23,6 +23,9 @@ int main(int argc, char *argv[]) {
                      std::function<void(void)>(mb_clwbvsntstore)),
       std::make_pair("clwbsfencedist",
                      std::function<void(void)>(mb_clwbsfencedist)),
+      std::make_pair("instoverhead",
+                     std::function<void(void)>(mb_instoverhead)),
+      std::make_pair("logappend", std::function<void(void)>(mb_logappend)),
       std::make_pair("msyncscaling",
                      std::function<void(void)>(mb_msyncscaling)),
       std::make_pair("workingsetsize",
@@ -10,5 +10,7 @@
 
 void mb_clwbsfencedist();
 void mb_clwbvsntstore();
+void mb_instoverhead();
+void mb_logappend();
 void mb_msyncscaling();
 void mb_workingsetsize();
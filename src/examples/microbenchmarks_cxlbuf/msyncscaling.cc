@@ -112,26 +112,38 @@ void mb_msyncscaling() {
 
   msync_thread((void *)ta);
 
-  Clock clk;
-  for (size_t tcount = 1; tcount < MAX_THREADS; tcount++) {
-    clk.reset();
-    clk.tick();
-    std::vector<pthread_t> tids;
-    for (size_t tid = 0; tid < tcount; tid++) {
-      tids.push_back(0);
-
-      const thread_arg_t *ta = new thread_arg_t({.tid = tid,
-                                                 .mem_region = mem_regions[tid],
-                                                 .total_threads = tcount});
-
-      pthread_create(&tids[tid], NULL, msync_thread, (void *)ta);
-    }
+  std::cout << "group_commit, tcount, ns, msyncs_per_sec\n";
 
-    for (size_t tid = 0; tid < tcount; tid++) {
-      pthread_join(tids[tid], NULL);
+  Clock clk;
+  for (const bool group_commit : {false, true}) {
+    groupCommit = group_commit;
+
+    for (size_t tcount = 1; tcount <= MAX_THREADS; tcount++) {
+      clk.reset();
+      clk.tick();
+      std::vector<pthread_t> tids;
+      for (size_t tid = 0; tid < tcount; tid++) {
+        tids.push_back(0);
+
+        const thread_arg_t *ta =
+            new thread_arg_t({.tid = tid,
+                              .mem_region = mem_regions[tid],
+                              .total_threads = tcount});
+
+        pthread_create(&tids[tid], NULL, msync_thread, (void *)ta);
+      }
+
+      for (size_t tid = 0; tid < tcount; tid++) {
+        pthread_join(tids[tid], NULL);
+      }
+      clk.tock();
+
+      const size_t msyncs = tcount * (MAX_LOOPS / tcount);
+      const double msyncs_per_sec = msyncs * 1e9 / clk.ns();
+
+      std::cout << group_commit << ", " << tcount << ", " << clk.ns() << ", "
+                << msyncs_per_sec << "\n";
     }
-    clk.tock();
-    std::cout << tcount << ", " << clk.ns() << "\n";
   }
 
   // /* Generate results */
@@ -16,6 +16,7 @@
 #include <boost/interprocess/sync/interprocess_mutex.hpp>
 #include <boost/interprocess/sync/mutex_family.hpp>
 
+#include "libstoreinst.hh"
 #include "nvsl/error.hh"
 
 #include <cassert>
@@ -44,17 +45,17 @@ namespace libpuddles {
 
     template <typename T>
     T *allocate_root() {
-      return (T *)ator->construct<T>("root")();
+      return CXLBUF_PMEM((T *)ator->construct<T>("root")());
     }
 
     template <typename T>
     T *get_root() {
-      return (T *)ator->find<T>("root").first;
+      return CXLBUF_PMEM((T *)ator->find<T>("root").first);
     }
 
     template <typename T>
     T *malloc(const size_t count = 1) {
-      return (T *)ator->allocate(sizeof(T) * count);
+      return CXLBUF_PMEM((T *)ator->allocate(sizeof(T) * count));
     };
 
     void free(void *ptr) { ator->deallocate(ptr); }
@@ -131,7 +131,7 @@ void libpuddles::obj::vector<T>::push_back(reservoir_t *res,
   if constexpr (hasInit<T>) {
     this->content[_size++].init(res, new_elem);
   } else {
-    this->content[_size] = new_elem;
+    CXLBUF_PMEM(this->content)[_size] = new_elem;
     // libcommon::pmemops->flush(&this->content[_size],
                               // sizeof(this->content[_size]));
     _size++;
@@ -167,7 +167,7 @@ void libpuddles::obj::vector<T>::set_at(reservoir_t *res, const T &new_elem,
                                         size_t idx) {
   // TODO: idx check
   // TX_ADD(&this->content[idx]);
-  this->content[idx] = new_elem;
+  CXLBUF_PMEM(this->content)[idx] = new_elem;
   // libcommon::pmemops->flush(&this->content[idx], sizeof(this->content[idx]));
 
   // TODO: flush (and fence?)
@@ -185,7 +185,7 @@ void libpuddles::obj::vector<T>::init(reservoir_t *res, const T *elems,
 
   if constexpr (std::is_trivial<T>::value) {
     const auto buf_sz = sizeof(this->content[0]) * num;
-    memcpy((void *)this->content, (void *)elems, buf_sz);
+    memcpy((void *)CXLBUF_PMEM(this->content), (void *)elems, buf_sz);
     // libcommon::pmemops->flush(this->content, buf_sz);
   } else {
     // for (size_t i = 0; i < elems._size; ++i) {
@@ -211,14 +211,15 @@ void libpuddles::obj::vector<T>::init(
 
   if constexpr (std::is_trivial<T>::value) {
     const auto buf_sz = sizeof(this->content[0]) * this->_size;
-    memcpy((void *)this->content, (void *)new_elems.content, buf_sz);
+    memcpy((void *)CXLBUF_PMEM(this->content), (void *)new_elems.content,
+           buf_sz);
     // libcommon::pmemops->flush(this->content, buf_sz);
   } else {
     for (size_t i = 0; i < new_elems._size; ++i) {
       if constexpr (hasInit<T>) {
         this->content[i].init(res, new_elems.content[i]);
       } else {
-        this->content[i] = new_elems.content[i];
+        CXLBUF_PMEM(this->content)[i] = new_elems.content[i];
         // libcommon::pmemops->flush(&this->content[i], sizeof(this->content[0]));
       }
     }
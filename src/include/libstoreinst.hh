@@ -8,11 +8,22 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <unistd.h>
 
 #define BUF_SIZE (100 * 1000 * 4096UL)
 #define MS_FORCE_SNAPSHOT 32
+/** @brief msync() flag: snapshot every thread's log instead of the caller's */
+#define MS_SNAPSHOT_ALL 64
+
+/**
+ * @brief Mark @p ptr as pointing to PMEM
+ * @details The storeinst pass drops the range check for stores through
+ * pointers derived from @p ptr and removes the marker. Without the pass the
+ * marker is a call to the runtime's identity function.
+ */
+#define CXLBUF_PMEM(ptr) ((decltype(ptr))cxlbuf_pmem((void *)(ptr)))
 
 namespace nvsl {
   class PMemOps;
@@ -33,10 +44,44 @@ void *memmove(void *__restrict dst, const void *__restrict src,
               size_t n) __THROW;
 
 extern bool startTracking;
+
+/**
+ * @brief Persist the calling thread's stores in [addr, addr+length)
+ * @details With MS_SNAPSHOT_ALL the logs of all threads are persisted, each
+ * under its own lock. The other threads can keep logging elsewhere, but must
+ * not be storing to [addr, addr+length) meanwhile.
+ */
 int snapshot(void *addr, size_t length, int flags);
 
+/**
+ * @brief Start persisting the calling thread's stores in [addr, addr+length)
+ * and return without waiting for them, msync(MS_ASYNC) calls this
+ * @details msync() with MS_ASYNC and other flags takes a synchronous
+ * snapshot() instead, MS_ASYNC | MS_SYNC fails with EINVAL. The stores are
+ * captured before this returns, later stores to the range belong to the next
+ * snapshot. A crash before the ticket completes rolls back to the previous
+ * durable snapshot.
+ * @return Ticket for snapshot_wait() and snapshot_done(), only valid on the
+ * calling thread
+ */
+uint64_t snapshot_async(void *addr, size_t length);
+
+/** @brief Wait until the snapshot_async() of @p ticket is durable */
+int snapshot_wait(uint64_t ticket);
+
+/** @brief Check if the snapshot_async() of @p ticket is durable */
+bool snapshot_done(uint64_t ticket);
+
 void libstoreinst_ctor();
 
+/**
+ * @brief Identity function the storeinst pass recognizes, see CXLBUF_PMEM()
+ * @details Weak and noinline, so the call survives until the pass runs even
+ * when that is in the linker's LTO pipeline (DCLANG_LTO). Defined here so
+ * programs built without the pass or the runtime still link.
+ */
+__attribute__((weak, noinline)) void *cxlbuf_pmem(void *ptr) { return ptr; }
+
 extern void *start_addr, *end_addr;
 extern size_t current_log_off, current_log_cnt;
 extern bool startTracking;
@@ -50,6 +95,15 @@ extern nvsl::PMemOps *pmemops;
 extern bool firstSnapshot;
 extern bool crashOnCommit;
 extern bool nopMsync;
+extern bool libcLogging;
+extern bool logDedup;
+extern bool logNtStore;
 extern nvsl::Clock *perst_overhead_clk;
 extern size_t msyncSleepNs;
+extern size_t logCapacity;
+extern size_t logSlots;
+extern size_t applyThreads;
+extern int applyNode;
+extern bool groupCommit;
+extern size_t groupWaitNs;
 extern nvsl::Counter snapshots, real_msyncs;
@@ -0,0 +1,83 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+#pragma once
+
+/**
+ * @file   ntstore.hh
+ * @date   octobre 17, 2026
+ * @brief  Copy to PMEM with non-temporal (streaming) stores
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace nvsl {
+  namespace cxlbuf {
+    /**
+     * @brief Copy @p bytes from @p src to @p dst bypassing the cache
+     *
+     * @details Whole cachelines use the widest streaming store available
+     * (AVX-512, AVX2 or SSE2), 8-byte aligned words around them use movnti.
+     * Whatever is left (less than 8 bytes at either end, or an unaligned
+     * word) is written with regular stores and must still be flushed.
+     *
+     * Streaming stores are weakly ordered, an sfence (pmemops->drain()) is
+     * needed before anything that depends on the copy being durable.
+     *
+     * @return true if every byte was written with streaming stores
+     */
+    inline bool stream_copy(void *dst, const void *src, size_t bytes) {
+      auto *d = (uint8_t *)dst;
+      auto *s = (const uint8_t *)src;
+      bool all_nt = true;
+
+      /* Head: up to the first cacheline boundary */
+      while (bytes != 0 and (uintptr_t)d % 64 != 0) {
+        if ((uintptr_t)d % 8 == 0 and bytes >= 8) {
+          int64_t word;
+          std::memcpy(&word, s, 8);
+          _mm_stream_si64((long long *)d, word);
+          d += 8, s += 8, bytes -= 8;
+        } else {
+          *d++ = *s++;
+          bytes--;
+          all_nt = false;
+        }
+      }
+
+      /* Body: whole cachelines */
+      for (; bytes >= 64; d += 64, s += 64, bytes -= 64) {
+#if defined(AVX512F_AVAIL)
+        _mm512_stream_si512((__m512i *)d,
+                            _mm512_loadu_si512((const void *)s));
+#elif defined(AVX2_AVAIL)
+        _mm256_stream_si256(
+            (__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        _mm256_stream_si256(
+            (__m256i *)(d + 32), _mm256_loadu_si256((const __m256i *)(s + 32)));
+#else
+        for (size_t off = 0; off < 64; off += 16) {
+          _mm_stream_si128((__m128i *)(d + off),
+                           _mm_loadu_si128((const __m128i *)(s + off)));
+        }
+#endif
+      }
+
+      /* Tail: aligned words, then bytes */
+      for (; bytes >= 8; d += 8, s += 8, bytes -= 8) {
+        int64_t word;
+        std::memcpy(&word, s, 8);
+        _mm_stream_si64((long long *)d, word);
+      }
+
+      if (bytes != 0) {
+        std::memcpy(d, s, bytes);
+        all_nt = false;
+      }
+
+      return all_nt;
+    }
+  } // namespace cxlbuf
+} // namespace nvsl
@@ -0,0 +1,142 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   applypool.cc
+ * @date   octobre 17, 2026
+ * @brief  Worker pool that copies snapshot() extents to the backing file
+ */
+
+#include "applypool.hh"
+#include "libcxlfs/numabinder.hh"
+#include "libstoreinst.hh"
+#include "ntstore.hh"
+#include "nvsl/common.hh"
+#include "nvsl/pmemops.hh"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+using namespace nvsl;
+using cxlbuf::apply_pool::job_t;
+
+/** @brief Serializes snapshot()s from different threads using the pool */
+static std::mutex run_mutex;
+
+/* Never destroyed, the detached workers still wait on them at exit */
+static auto *pool_mutex = new std::mutex;
+static auto *work_cv = new std::condition_variable;
+static auto *done_cv = new std::condition_variable;
+
+/** @brief Share of each worker for the current run */
+static std::vector<std::vector<job_t>> *shares = nullptr;
+static uint64_t generation = 0;
+static size_t pending = 0;
+
+/** @brief Streaming-copy @p jobs, only their first and last lines may hold
+ * regular stores */
+static void copy(const std::vector<job_t> &jobs) {
+  for (const auto &job : jobs) {
+    if (not cxlbuf::stream_copy(job.dst, job.src, job.bytes)) {
+      pmemops->flush(job.dst, 1);
+      pmemops->flush((uint8_t *)job.dst + job.bytes - 1, 1);
+    }
+  }
+}
+
+static void worker(size_t id, int node) {
+  NumaBinder binder;
+  if (binder.bind_to_node(node) == -1) {
+    DBGW << "Unable to bind apply worker " << id << " to node " << node
+         << std::endl;
+  }
+
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(*pool_mutex);
+
+  while (true) {
+    work_cv->wait(lock, [&] { return generation != seen; });
+    seen = generation;
+
+    lock.unlock();
+    copy((*shares)[id]);
+    pmemops->drain();
+    lock.lock();
+
+    if (--pending == 0) done_cv->notify_all();
+  }
+}
+
+static void start_workers() {
+  const int node =
+      applyNode == -1 ? NumaBinder::get_cur_numa_node() : applyNode;
+
+  DBGH(1) << "Starting " << applyThreads << " apply workers on node " << node
+          << std::endl;
+
+  shares = new std::vector<std::vector<job_t>>(applyThreads + 1);
+  for (size_t id = 0; id < applyThreads; id++) {
+    std::thread(worker, id, node).detach();
+  }
+}
+
+bool cxlbuf::apply_pool::enabled() { return applyThreads != 0; }
+
+void cxlbuf::apply_pool::run(const std::vector<job_t> &jobs) {
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+
+  if (shares == nullptr) [[unlikely]] {
+    start_workers();
+  }
+
+  size_t total = 0;
+  for (const auto &job : jobs) total += job.bytes;
+
+  /* Cut the jobs into one share per worker and one for this thread */
+  const size_t share_cnt = shares->size();
+  const size_t share_sz = ((total + share_cnt - 1) / share_cnt + 63) & ~63UL;
+
+  for (auto &share : *shares) share.clear();
+
+  size_t cur = 0, cur_bytes = 0;
+  for (const auto &job : jobs) {
+    size_t off = 0;
+
+    while (off < job.bytes) {
+      auto *dst = (uint8_t *)job.dst + off;
+      size_t len = job.bytes - off;
+
+      /* The last share takes the rest, the others end at a line boundary so
+         no line is written by two threads */
+      if (cur + 1 < share_cnt) {
+        len = std::min(len, share_sz - cur_bytes);
+
+        const uintptr_t job_end = (uintptr_t)job.dst + job.bytes;
+        const uintptr_t cut = ((uintptr_t)dst + len + 63) & ~63UL;
+        len = std::min(cut, job_end) - (uintptr_t)dst;
+      }
+
+      (*shares)[cur].push_back({dst, (const uint8_t *)job.src + off, len});
+      off += len;
+      cur_bytes += len;
+
+      if (cur_bytes >= share_sz and cur + 1 < share_cnt) {
+        cur++;
+        cur_bytes = 0;
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(*pool_mutex);
+    pending = applyThreads;
+    generation++;
+  }
+  work_cv->notify_all();
+
+  copy(shares->back());
+
+  std::unique_lock<std::mutex> lock(*pool_mutex);
+  done_cv->wait(lock, [] { return pending == 0; });
+}
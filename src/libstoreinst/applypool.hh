@@ -0,0 +1,43 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   applypool.hh
+ * @date   octobre 17, 2026
+ * @brief  Worker pool that copies snapshot() extents to the backing file
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace nvsl {
+  namespace cxlbuf {
+    namespace apply_pool {
+      /** @brief Copy of [src, src+bytes) to the backing file at dst */
+      struct job_t {
+        void *dst;
+        const void *src;
+        size_t bytes;
+      };
+
+      /** @brief Extents smaller than this are applied inline by snapshot() */
+      constexpr size_t MIN_JOB_SZ = 64 * 1024;
+
+      /** @brief Check if CXLBUF_APPLY_THREADS asks for a pool */
+      bool enabled();
+
+      /**
+       * @brief Copy @p jobs to the backing file with the workers and the
+       * calling thread
+       *
+       * @details The bytes are split in equal shares cut at cacheline
+       * boundaries. Workers are started on the first call and bound to
+       * CXLBUF_APPLY_NODE (default: the caller's node) with NumaBinder.
+       * Every worker drains its own stores before this returns. The caller's
+       * share is only drained by its next pmemops->drain().
+       */
+      void run(const std::vector<job_t> &jobs);
+    } // namespace apply_pool
+  }   // namespace cxlbuf
+} // namespace nvsl
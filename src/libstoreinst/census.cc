@@ -0,0 +1,131 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   census.cc
+ * @date   octobre 17, 2026
+ * @brief  Store-site census for profile-guided instrumentation
+ */
+
+#include "census.hh"
+#include "nvsl/common.hh"
+#include "nvsl/envvars.hh"
+
+#include <fstream>
+#include <ios>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+NVSL_DECL_ENV(CXLBUF_CENSUS_FILE);
+NVSL_DECL_ENV(CXLBUF_SITE_HITS_FILE);
+
+using namespace nvsl;
+
+static std::mutex census_mutex;
+static std::vector<uint64_t> *census_sites = nullptr;
+
+struct site_hits_t {
+  size_t hits;
+  size_t bytes;
+};
+
+using site_hits_map_t = std::unordered_map<uint64_t, site_hits_t>;
+
+/** @brief Counts of one thread, its lock is only contended by dump() */
+struct thread_hits_t {
+  std::mutex mutex;
+  site_hits_map_t sites;
+};
+
+/* Per-thread counts, registered once per thread and merged on dump(). Never
+   freed, so the counts of the threads that exited are kept. */
+static thread_local thread_hits_t *local_site_hits = nullptr;
+static std::vector<thread_hits_t *> *all_site_hits = nullptr;
+
+void cxlbuf::census::record(uint64_t site_id) {
+  std::lock_guard<std::mutex> guard(census_mutex);
+
+  /* Each site only reports once per process, see emitCensusHit() in the pass */
+  if (census_sites == nullptr) {
+    census_sites = new std::vector<uint64_t>;
+  }
+
+  census_sites->push_back(site_id);
+}
+
+void cxlbuf::census::count(uint64_t site_id, size_t bytes) {
+  if (local_site_hits == nullptr) [[unlikely]] {
+    std::lock_guard<std::mutex> guard(census_mutex);
+
+    if (all_site_hits == nullptr) {
+      all_site_hits = new std::vector<thread_hits_t *>;
+    }
+
+    local_site_hits = new thread_hits_t;
+    all_site_hits->push_back(local_site_hits);
+  }
+
+  std::lock_guard<std::mutex> guard(local_site_hits->mutex);
+
+  auto &site = local_site_hits->sites[site_id];
+  site.hits++;
+  site.bytes += bytes;
+}
+
+/** @details Other threads may still be counting, each thread's counts are
+ * read under its lock */
+static void dump_site_hits() {
+  if (all_site_hits == nullptr) return;
+
+  site_hits_map_t total;
+  for (auto *thread_hits : *all_site_hits) {
+    std::lock_guard<std::mutex> guard(thread_hits->mutex);
+
+    for (const auto &[site_id, site] : thread_hits->sites) {
+      total[site_id].hits += site.hits;
+      total[site_id].bytes += site.bytes;
+    }
+  }
+
+  const auto fname =
+      get_env_str(CXLBUF_SITE_HITS_FILE_ENV, "/tmp/cxlbuf.sitehits");
+
+  std::ofstream hits_file(fname, std::ios::app);
+  if (not hits_file.is_open()) {
+    DBGE << "Unable to open site hits file " << fname << std::endl;
+    return;
+  }
+
+  /* <site id> <hits> <bytes logged> */
+  for (const auto &[site_id, site] : total) {
+    hits_file << std::hex << site_id << std::dec << " " << site.hits << " "
+              << site.bytes << "\n";
+  }
+
+  DBGH(1) << "Wrote the hits of " << total.size() << " store sites to "
+          << fname << std::endl;
+}
+
+void cxlbuf::census::dump() {
+  std::lock_guard<std::mutex> guard(census_mutex);
+
+  dump_site_hits();
+
+  if (census_sites == nullptr) return;
+
+  const auto fname =
+      get_env_str(CXLBUF_CENSUS_FILE_ENV, "/tmp/cxlbuf.census");
+
+  std::ofstream census_file(fname, std::ios::app);
+  if (not census_file.is_open()) {
+    DBGE << "Unable to open census file " << fname << std::endl;
+    return;
+  }
+
+  for (const auto site_id : *census_sites) {
+    census_file << std::hex << site_id << "\n";
+  }
+
+  DBGH(1) << "Wrote " << census_sites->size() << " store sites to " << fname
+          << std::endl;
+}
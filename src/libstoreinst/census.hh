@@ -0,0 +1,33 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   census.hh
+ * @date   octobre 17, 2026
+ * @brief  Store-site census for profile-guided instrumentation
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nvsl {
+  namespace cxlbuf {
+    namespace census {
+      /** @brief Record a store site that hit the tracked range */
+      void record(uint64_t site_id);
+
+      /** @brief Count a hit of a store site logging @p bytes */
+      void count(uint64_t site_id, size_t bytes);
+
+      /**
+       * @brief Append the recorded site IDs to CXLBUF_CENSUS_FILE and the
+       * per-site counts to CXLBUF_SITE_HITS_FILE
+       * @details The census file is rebuilt with DCLANG_PROFILE=<file> to only
+       * keep the full instrumentation on the sites listed in it. Site IDs match
+       * the ones in the pass's DCLANG_REPORT file.
+       */
+      void dump();
+    } // namespace census
+  }   // namespace cxlbuf
+} // namespace nvsl
@@ -1,10 +1,12 @@
 // -*- mode: c++; c-basic-offset: 2; -*-
 
 #include "libc_wrappers.hh"
+#include "applypool.hh"
 #include "libcxlfs/controller.hh"
 #include "libcxlfs/libcxlfs.hh"
 #include "libstoreinst.hh"
 #include "log.hh"
+#include "ntstore.hh"
 #include "nvsl/clock.hh"
 #include "nvsl/common.hh"
 #include "nvsl/envvars.hh"
@@ -16,10 +18,16 @@
 
 #include <bit>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <dlfcn.h>
 #include <filesystem>
+#include <mutex>
 #include <numeric>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
 
 namespace fs = std::filesystem;
@@ -139,7 +147,8 @@ void *memcpy(void *__restrict dst, const void *__restrict src,
 
   assert(real_memcpy != nullptr);
 
-  if (startTracking and start_addr != nullptr and addr_in_range(dst)) {
+  if (libcLogging and startTracking and start_addr != nullptr and
+      addr_in_range(dst)) {
     local_log.log_range(dst, n);
   }
 
@@ -154,7 +163,8 @@ void *memmove(void *__restrict dst, const void *__restrict src,
 
   assert(real_memmove != nullptr);
 
-  if (startTracking and start_addr != nullptr and addr_in_range(dst)) {
+  if (libcLogging and startTracking and start_addr != nullptr and
+      addr_in_range(dst)) {
     local_log.log_range(dst, n);
     memmove_logged = true;
   }
@@ -171,7 +181,7 @@ void *memset(void *s, int c, size_t n) {
   // fprintf(stderr, "Memset [%p:%p] %lu KiB\n", s, (void *)((char *)s + n),
   //         n / 1024);
 
-  if (addr_in_range(s) || addr_in_range((char *)s + n)) {
+  if (libcLogging and (addr_in_range(s) || addr_in_range((char *)s + n))) {
     if (startTracking) {
       local_log.log_range(s, n);
     }
@@ -239,6 +249,19 @@ int msync(void *__addr, size_t __len, int __flags) {
   if (!real_msync) nvsl::cxlbuf::init_dlsyms();
 
   DBGH(4) << "Intercepted call to " << __FUNCTION__ << "\n";
+
+  if ((__flags & MS_ASYNC) and (__flags & MS_SYNC)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Only a plain MS_ASYNC is asynchronous, with other flags (MS_INVALIDATE,
+     MS_SNAPSHOT_ALL, ...) the synchronous snapshot() handles them */
+  if (__flags == MS_ASYNC and storeInstEnabled) {
+    snapshot_async(__addr, __len);
+    return 0;
+  }
+
   return snapshot(__addr, __len, __flags);
 }
 
@@ -304,271 +327,406 @@ int fdatasync(int __fildes) {
   return result;
 }
 
-__attribute__((unused)) int snapshot(void *addr, size_t bytes, int flags) {
-  ++snapshots;
-  if (nopMsync) [[unlikely]] {
-    DBGH(1) << "!!! Nop msync !!!\n";
-    return 0;
-  }
-
-#if defined(NO_PERSIST_OPS) || defined(NO_CHECK_MEMORY)
-  DBGH(1) << "!!! No persist ops !!!\n";
-  return 0;
-#endif
-
-#ifdef CXLBUF_TESTING_GOODIES
-  perst_overhead_clk->tick();
-#endif
+/**
+ * @brief First snapshot of a process: copy all the mapped regions from their
+ * source to the backing files
+ * @details Threads racing on their first snapshot wait for the copy.
+ */
+static void sync_backing_files(void *addr) {
+  static std::mutex first_mutex;
+  std::lock_guard<std::mutex> lock(first_mutex);
 
-#ifdef TRACE_LOG_MSYNC
-  const std::string snapshot_msg = "snapshot\n";
-  write(trace_fd, snapshot_msg.c_str(), strlen(snapshot_msg.c_str()));
-#endif
+  if (not firstSnapshot) return;
 
-  auto pm_back = RCast<uint8_t *>(cxlbuf::backing_file_start);
+  DBGH(1) << "== First snapshot ==" << std::endl;
 
-  if (tls_logs == nullptr) {
-    tls_logs = new std::vector<nvsl::cxlbuf::Log *>;
-  }
+  /* If this is the first snapshot, copy all the mapped regions from their
+     source to the backing files. This allows us to get the two copies on
+     parity. */
+  for (const auto &entry : cxlbuf::mapped_addr) {
+    const auto fname = entry.second.fpath;
+    const auto erange = entry.second.range;
 
-  DBGH(2) << "Found " << tls_logs->size() << " TLS logs\n";
+    if (erange.start <= (size_t)addr and erange.end > (size_t)addr) {
+      DBGH(2) << "Found the entry " << entry.first << " (=" << fs::path(fname)
+              << ") [" << (void *)erange.start << ", " << (void *)erange.end
+              << "]" << std::endl;
 
-  if (storeInstEnabled) [[likely]] {
-    for (auto tls_log_ptr : *tls_logs) {
-      auto &tls_log = *tls_log_ptr;
+      const size_t off = erange.start - 0x10000000000;
+      void *dst = RCast<uint8_t *>(nvsl::cxlbuf::backing_file_start) + off;
 
-      tls_log.flush_all();
+      const void *src = (void *)(erange.start);
 
-      /* Drain all the stores to the log and update its state before modifying
-         the backing file */
-      tls_log.log_area->log_offset = 0;
-      tls_log.set_state(cxlbuf::Log::State::ACTIVE, true);
+      const size_t memcpy_sz = fname == "" ? (erange.end - erange.start)
+                                           : fs::file_size(fname);
 
-      if ((flags & MS_FORCE_SNAPSHOT) and !storeInstEnabled) {
-        DBGE << "MS_FORCE_SNAPSHOT called with no sign of instrumentation\n";
-        exit(1);
-      }
+      /* Copy all the allocated bytes from the actual file to the backing */
+      DBGH(4) << "Calling real_memcpy(" << dst << ", " << src << ", "
+              << memcpy_sz << ")" << std::endl;
+      real_memcpy(dst, src, memcpy_sz);
+      break;
+    }
+  }
 
-      DBGH(1) << "Call to snapshot(" << addr << ", " << bytes << ", " << flags
-              << ")\n";
-      if (firstSnapshot) [[unlikely]] {
-        DBGH(1) << "== First snapshot ==" << std::endl;
-        firstSnapshot = false;
-
-        /* If this is the first snapshot, copy all the mapped regions from their
-           source to the backing files. This allows us to get the two copies on
-           parity. */
-        for (const auto &entry : cxlbuf::mapped_addr) {
-          const auto fname = entry.second.fpath;
-          const auto erange = entry.second.range;
-
-          if (erange.start <= (size_t)addr and erange.end > (size_t)addr) {
-            DBGH(2) << "Found the entry " << entry.first
-                    << " (=" << fs::path(fname) << ") [" << (void *)erange.start
-                    << ", " << (void *)erange.end << "]" << std::endl;
-
-            const size_t off = erange.start - 0x10000000000;
-            void *dst =
-                RCast<uint8_t *>(nvsl::cxlbuf::backing_file_start) + off;
-
-            const void *src = (void *)(erange.start);
-
-            const size_t memcpy_sz = fname == "" ? (erange.end - erange.start)
-                                                 : fs::file_size(fname);
-
-            /* Copy all the allocated bytes from the actual file to the backing
-             */
-            DBGH(4) << "Calling real_memcpy(" << dst << ", " << src << ", "
-                    << memcpy_sz << ")" << std::endl;
-            real_memcpy(dst, src, memcpy_sz);
-            break;
-          }
-        }
+  if (nvsl::libcxlfs::ctrlr) {
+    std::cerr << "resizing cache\n";
+    nvsl::libcxlfs::ctrlr->resize_cache(nvsl::libcxlfs::CACHE_SIZE >> 12);
+    nvsl::libcxlfs::ctrlr->reset_stats();
+  }
 
-        if (nvsl::libcxlfs::ctrlr) {
-          std::cerr << "resizing cache\n";
-          nvsl::libcxlfs::ctrlr->resize_cache(nvsl::libcxlfs::CACHE_SIZE >> 12);
-          nvsl::libcxlfs::ctrlr->reset_stats();
-        }
-      }
+  firstSnapshot = false;
+}
 
-      DBGH(1) << "Calling snapshot (not msync)" << std::endl;
+/**
+ * @brief Copy the entries of @p tls_log in [addr, addr+bytes) to the backing
+ * file without draining, extents for the apply pool go to @p pool_jobs
+ */
+static void apply_log(cxlbuf::Log &tls_log, void *addr, size_t bytes,
+                      uint8_t *pm_back,
+                      std::vector<cxlbuf::apply_pool::job_t> &pool_jobs) {
+  DBGH(1) << "Calling snapshot (not msync)" << std::endl;
 
-      size_t total_proc = 0;
-      size_t bytes_flushed = 0;
-      size_t start = (uint64_t)addr, end = (uint64_t)addr + bytes;
-      size_t diff = end - start;
+  size_t total_proc = 0;
+  size_t bytes_flushed = 0;
+  size_t start = (uint64_t)addr, end = (uint64_t)addr + bytes;
+  size_t diff = end - start;
 
 #if LOG_FORMAT_VOLATILE
-      auto &log_list = tls_log.entries;
-
-      if (log_list.size() > 10) {
-        std::sort(log_list.begin(), log_list.end(),
-                  [](nvsl::cxlbuf::Log::log_entry_lean_t a,
-                     nvsl::cxlbuf::Log::log_entry_lean_t b) -> bool {
-                    return a.addr < b.addr;
-                  });
-      }
-
-#ifndef RELEASE
-
-      for (size_t i = 1; i < log_list.size(); i++) {
-        if (log_list[i].addr == log_list[i - 1].addr + log_list[i - 1].bytes) {
-          ++(*cxlbuf::mergeable_entries);
-        }
-      }
-#endif // RELEASE
-
+  /* Sorted and disjoint extents, see Log::range_set_t */
+  const auto &log_list = tls_log.entries;
 #elif LOG_FORMAT_NON_VOLATILE
-      const auto &log_list = *tls_log.log_area;
+  const auto &log_list = *tls_log.log_area;
 #else
 #error "Log format needs to be volatile or non-volatile."
 #endif
 
-      size_t applied_cnt = 0, entry_cnt = 0;
-#if LOG_FORMAT_VOLATILE
-      for (size_t i = 0; i < log_list.size(); i++) {
-        const auto &entry = log_list.at(i);
-        bool skip_entry =
-            (i > 0) and ((log_list[i].addr == log_list[i - 1].addr) and
-                         (log_list[i].bytes == log_list[i - 1].bytes));
-#elif LOG_FORMAT_NON_VOLATILE
-      for (const auto &entry : log_list) {
-        bool skip_entry = false;
-#endif
+  size_t applied_cnt = 0, entry_cnt = 0;
 
-        /* Copy the logged location to the backing store if in range of
-           snapshot */
-        if ((entry.addr - start <= diff)) {
-          entry_cnt++;
-        }
+  /* Large extents are left to the apply pool */
+  const bool use_pool = cxlbuf::apply_pool::enabled();
 
-        if ((entry.addr - start <= diff) and skip_entry) {
-#ifndef RELEASE
-          ++(*cxlbuf::dup_log_entries);
-#endif // RELEASE
-          applied_cnt++;
-        }
+  for (const auto &entry : log_list) {
+    /* Copy the logged location to the backing store if in range of
+       snapshot */
+    if ((entry.addr - start <= diff)) {
+      entry_cnt++;
+    }
 
-        if ((entry.addr - start <= diff) and not skip_entry) {
-          const size_t offset = entry.addr - (uint64_t)start_addr;
-          const size_t dst_addr = (size_t)(pm_back + offset);
+    if ((entry.addr - start <= diff)) {
+      const size_t offset = entry.addr - (uint64_t)start_addr;
+      const size_t dst_addr = (size_t)(pm_back + offset);
 
 #ifndef RELEASE
-          ++(*nvsl::cxlbuf::total_pers_log_entries);
+      ++(*nvsl::cxlbuf::total_pers_log_entries);
 #endif // RELEASE
 
-          applied_cnt++;
+      applied_cnt++;
 
-          DBGH(4) << "Copying " << entry.bytes << " bytes from "
-                  << (void *)(0UL + entry.addr) << " -> " << (void *)dst_addr
-                  << std::endl;
+      DBGH(4) << "Copying " << entry.bytes << " bytes from "
+              << (void *)(0UL + entry.addr) << " -> " << (void *)dst_addr
+              << std::endl;
 
 #ifdef CXLBUF_ALIGN_SNAPSHOT_WRITES
-          const bool str_wr_allowed = true;
+      const bool str_wr_allowed = true;
 #else
-          /* Streaming write is only allowed if the write size is a power of two
-             (popcount == 1) and dest address is aligned at entry.bytes */
-          const bool str_wr_allowed = (std::popcount(entry.bytes) == 1) and
-                                      (dst_addr % entry.bytes == 0);
+      /* Streaming write is only allowed if the write size is a power of two
+         (popcount == 1) and dest address is aligned at entry.bytes */
+      const bool str_wr_allowed = (std::popcount(entry.bytes) == 1) and
+                                  (dst_addr % entry.bytes == 0);
 #endif // CXLBUF_ALIGN_SNAPSHOT_WRITES
-          if (str_wr_allowed and entry.bytes >= 8) [[likely]] {
-            size_t dst_addr_aligned = dst_addr;
+      if (use_pool and entry.bytes >= cxlbuf::apply_pool::MIN_JOB_SZ) {
+        pool_jobs.push_back(
+            {(void *)dst_addr, (void *)(0UL + entry.addr), entry.bytes});
+#ifndef RELEASE
+        *cxlbuf::total_bytes_wr += entry.bytes;
+        *cxlbuf::total_bytes_wr_strm += entry.bytes;
+#endif
+      } else if (str_wr_allowed and entry.bytes >= 8) [[likely]] {
+        size_t dst_addr_aligned = dst_addr;
 
-            const size_t prev_pwr_2 = previousPowerOfTwo(entry.bytes) + 1;
-            size_t align_to = prev_pwr_2 > 9 ? 9 : prev_pwr_2;
-            align_to =
-                (std::popcount(entry.bytes) == 1) ? align_to - 1 : align_to;
+        const size_t prev_pwr_2 = previousPowerOfTwo(entry.bytes) + 1;
+        size_t align_to = prev_pwr_2 > 9 ? 9 : prev_pwr_2;
+        align_to =
+            (std::popcount(entry.bytes) == 1) ? align_to - 1 : align_to;
 
-            dst_addr_aligned >>= align_to;
-            dst_addr_aligned <<= align_to;
+        dst_addr_aligned >>= align_to;
+        dst_addr_aligned <<= align_to;
 
-            const size_t modulo = dst_addr & ((1 << align_to) - 1);
+        const size_t modulo = dst_addr & ((1 << align_to) - 1);
 
-            dst_addr_aligned = (modulo == 0) ? dst_addr : dst_addr_aligned;
+        dst_addr_aligned = (modulo == 0) ? dst_addr : dst_addr_aligned;
 
-            const size_t new_sz_pfx_al =
-                entry.bytes + (dst_addr - dst_addr_aligned);
-            const size_t new_sz_sfx_al =
-                ((1UL << align_to) >= entry.bytes)
-                    ? (1UL << align_to)
-                    : (entry.bytes / 256 + (entry.bytes % 256 ? 1 : 0)) * 256;
-            const size_t new_sz =
-                (dst_addr == dst_addr_aligned) ? new_sz_sfx_al : new_sz_pfx_al;
+        const size_t new_sz_pfx_al =
+            entry.bytes + (dst_addr - dst_addr_aligned);
+        const size_t new_sz_sfx_al =
+            ((1UL << align_to) >= entry.bytes)
+                ? (1UL << align_to)
+                : (entry.bytes / 256 + (entry.bytes % 256 ? 1 : 0)) * 256;
+        const size_t new_sz =
+            (dst_addr == dst_addr_aligned) ? new_sz_sfx_al : new_sz_pfx_al;
 
-            DBGH(4) << "Aligned " << (void *)dst_addr << " to "
-                    << (void *)dst_addr_aligned << " with new size = " << new_sz
-                    << " (prev_pwr_2=" << prev_pwr_2
-                    << ", align_to=" << align_to << ", modulo=" << modulo
-                    << ", dst_addr_aligned=" << (void *)dst_addr_aligned
-                    << ")\n";
+        DBGH(4) << "Aligned " << (void *)dst_addr << " to "
+                << (void *)dst_addr_aligned << " with new size = " << new_sz
+                << " (prev_pwr_2=" << prev_pwr_2
+                << ", align_to=" << align_to << ", modulo=" << modulo
+                << ", dst_addr_aligned=" << (void *)dst_addr_aligned
+                << ")\n";
 
 #ifdef CXLBUF_ALIGN_SNAPSHOT_WRITES
-            const size_t dst_addr_arg = dst_addr_aligned;
-            const size_t src_addr_arg =
-                dst_addr_arg - (size_t)pm_back + (size_t)start_addr;
-            //                entry.addr - (dst_addr_aligned - dst_addr);
-            DBGH(4) << "Changing entry.addr (=" << (void *)entry.addr << ") to "
-                    << (void *)entry.addr << " - (" << (void *)dst_addr_aligned
-                    << " - " << (void *)dst_addr
-                    << ") = " << (void *)src_addr_arg << "\n";
+        const size_t dst_addr_arg = dst_addr_aligned;
+        const size_t src_addr_arg =
+            dst_addr_arg - (size_t)pm_back + (size_t)start_addr;
+        //                entry.addr - (dst_addr_aligned - dst_addr);
+        DBGH(4) << "Changing entry.addr (=" << (void *)entry.addr << ") to "
+                << (void *)entry.addr << " - (" << (void *)dst_addr_aligned
+                << " - " << (void *)dst_addr
+                << ") = " << (void *)src_addr_arg << "\n";
 
 #else
-            const size_t dst_addr_arg = dst_addr;
-            const size_t src_addr_arg = entry.addr;
+        const size_t dst_addr_arg = dst_addr;
+        const size_t src_addr_arg = entry.addr;
 #endif
-            DBGH(4) << "streaming_wr(" << (void *)dst_addr_arg << ", "
-                    << (void *)src_addr_arg << ", " << new_sz << ")\n";
-            pmemops->streaming_wr((void *)dst_addr_arg, (void *)src_addr_arg,
-                                  new_sz);
+        DBGH(4) << "streaming_wr(" << (void *)dst_addr_arg << ", "
+                << (void *)src_addr_arg << ", " << new_sz << ")\n";
+        pmemops->streaming_wr((void *)dst_addr_arg, (void *)src_addr_arg,
+                              new_sz);
 #ifndef RELEASE
-            cxlbuf::total_bytes_wr->operator+=(new_sz);
-            cxlbuf::total_bytes_wr_strm->operator+=(new_sz);
+        cxlbuf::total_bytes_wr->operator+=(new_sz);
+        cxlbuf::total_bytes_wr_strm->operator+=(new_sz);
 #endif
-          } else {
-            real_memcpy((void *)dst_addr, (void *)(0UL + entry.addr),
-                        entry.bytes);
-            pmemops->flush((void *)dst_addr, entry.bytes);
+      } else if (entry.bytes >= 64) {
+        /* An extent of merged ranges, streamed out in one go */
+        if (not cxlbuf::stream_copy((void *)dst_addr,
+                                    (void *)(0UL + entry.addr),
+                                    entry.bytes)) {
+          pmemops->flush((void *)dst_addr, entry.bytes);
+        }
 #ifndef RELEASE
-            *cxlbuf::total_bytes_wr += entry.bytes;
+        *cxlbuf::total_bytes_wr += entry.bytes;
+        *cxlbuf::total_bytes_wr_strm += entry.bytes;
+#endif
+      } else {
+        real_memcpy((void *)dst_addr, (void *)(0UL + entry.addr),
+                    entry.bytes);
+        pmemops->flush((void *)dst_addr, entry.bytes);
+#ifndef RELEASE
+        *cxlbuf::total_bytes_wr += entry.bytes;
 #endif
-          }
-        } else if (entry.addr == 0) {
-          break;
-        }
-
-        bytes_flushed += entry.bytes;
-        total_proc++;
       }
+    } else if (entry.addr == 0) {
+      break;
+    }
 
-      DBGH(4) << "total_proc = " << total_proc << "\n";
-      DBGH(4) << "bytes_flushed = " << bytes_flushed << "\n";
+    bytes_flushed += entry.bytes;
+    total_proc++;
+  }
+
+  DBGH(4) << "total_proc = " << total_proc << "\n";
+  DBGH(4) << "bytes_flushed = " << bytes_flushed << "\n";
 
 #ifndef RELEASE
-      cxlbuf::tx_log_count_dist->add(total_proc);
+  cxlbuf::tx_log_count_dist->add(total_proc);
 #endif
 
 #ifdef CXLBUF_TESTING_GOODIES
-      if (crashOnCommit) [[unlikely]] {
-        DBGW << "Crashing before commit (CXLBUF_CRASH_ON_COMMIT is set)"
-             << std::endl;
-        exit(1);
-      }
+  if (crashOnCommit) [[unlikely]] {
+    DBGW << "Crashing before commit (CXLBUF_CRASH_ON_COMMIT is set)"
+         << std::endl;
+    exit(1);
+  }
 #endif // CXLBUF_TESTING_GOODIES
 
-      /* Update the state to drop the log and drain all the updates to the
-         backing file */
-      pmemops->drain();
+  if (applied_cnt != entry_cnt) {
+    DBGE << "applied_cnt " << applied_cnt << " entry_cnt " << entry_cnt
+         << "\n";
+    DBGE << "Not resetting log state on snapshot()\n";
+    exit(1);
+  }
+}
+
+/** @brief Apply the entries of @p tls_log in [addr, addr+bytes) to the
+ * backing file and empty it */
+static void snapshot_log(cxlbuf::Log &tls_log, void *addr, size_t bytes,
+                         uint8_t *pm_back) {
+  cxlbuf::Log::guard_t guard(tls_log, &tls_log == &local_log);
+
+#ifdef LOG_REDO
+  /* The commit is durable once the new values are in the log, the
+     backing file is updated in the background */
+  tls_log.commit_redo(addr, bytes, pm_back);
+  return;
+#endif
 
-      if (applied_cnt == entry_cnt) {
-        tls_log.set_state(cxlbuf::Log::State::EMPTY);
-      } else {
-        DBGE << "applied_cnt " << applied_cnt << " entry_cnt " << entry_cnt
-             << "\n";
-        DBGE << "Not resetting log state on snapshot()\n";
-        exit(1);
-      }
-      tls_log.clear();
+  tls_log.flush_all();
+
+  /* Drain all the stores to the log and update its state before modifying
+     the backing file */
+  tls_log.log_area->log_offset = 0;
+  tls_log.begin_commit();
+
+  std::vector<cxlbuf::apply_pool::job_t> pool_jobs;
+  apply_log(tls_log, addr, bytes, pm_back, pool_jobs);
+
+  if (not pool_jobs.empty()) {
+    cxlbuf::apply_pool::run(pool_jobs);
+  }
+
+  /* Update the state to drop the log and drain all the updates to the
+     backing file */
+  pmemops->drain();
+  tls_log.end_commit();
+}
+
+/** @brief A snapshot() queued for a group commit */
+struct group_req_t {
+  cxlbuf::Log *log;
+  void *addr;
+  size_t bytes;
+  bool done;
+};
+
+/* Never destroyed, exiting threads may still snapshot */
+static auto *group_mutex = new std::mutex;
+static auto *group_cv = new std::condition_variable;
+static auto *group_queue = new std::vector<group_req_t *>;
+static bool group_leader = false;
+
+/**
+ * @brief Commit the snapshots of @p batch together
+ * @details Three fences for the whole batch instead of three per snapshot:
+ * one for the logs and their ACTIVE state, one for the backing file and one
+ * for the EMPTY states.
+ */
+static void commit_group(const std::vector<group_req_t *> &batch,
+                         uint8_t *pm_back) {
+#ifdef LOG_REDO
+  /* A redo commit doesn't wait for the backing file, there is little to
+     share */
+  for (auto req : batch) {
+    snapshot_log(*req->log, req->addr, req->bytes, pm_back);
+  }
+  return;
+#endif
+
+  /* The owners wait for the group, MS_SNAPSHOT_ALL may not */
+  std::deque<cxlbuf::Log::guard_t> guards;
+  for (auto req : batch) guards.emplace_back(*req->log, req->log == &local_log);
+
+  for (auto req : batch) {
+    req->log->flush_all();
+    req->log->log_area->log_offset = 0;
+    req->log->begin_commit(false);
+  }
+  pmemops->drain();
+
+  std::vector<cxlbuf::apply_pool::job_t> pool_jobs;
+  for (auto req : batch) {
+    apply_log(*req->log, req->addr, req->bytes, pm_back, pool_jobs);
+  }
+
+  if (not pool_jobs.empty()) {
+    cxlbuf::apply_pool::run(pool_jobs);
+  }
+  pmemops->drain();
+
+  for (auto req : batch) req->log->end_commit(false);
+  pmemops->drain();
+}
+
+/**
+ * @brief snapshot() the calling thread's log with a group commit
+ * @details The log is queued and the first thread to find no leader commits
+ * the queue, after waiting CXLBUF_GROUP_WAIT_NS for more snapshots to join.
+ * Snapshots queued while a leader commits form the next group.
+ */
+static void group_snapshot(void *addr, size_t bytes, uint8_t *pm_back) {
+  group_req_t req = {&local_log, addr, bytes, false};
+
+  std::unique_lock<std::mutex> lock(*group_mutex);
+  group_queue->push_back(&req);
+
+  group_cv->wait(lock, [&] { return req.done or not group_leader; });
+  if (req.done) return;
+
+  group_leader = true;
+
+  if (groupWaitNs != 0) {
+    lock.unlock();
+
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::nanoseconds(groupWaitNs);
+    while (std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::yield();
+    }
+
+    lock.lock();
+  }
+
+  std::vector<group_req_t *> batch;
+  batch.swap(*group_queue);
+  lock.unlock();
+
+  DBGH(2) << "Group commit of " << batch.size() << " snapshots" << std::endl;
+
+#ifndef RELEASE
+  ++(*cxlbuf::group_commits);
+#endif
+
+  commit_group(batch, pm_back);
+
+  lock.lock();
+  for (auto member : batch) member->done = true;
+  group_leader = false;
+  lock.unlock();
+
+  group_cv->notify_all();
+}
+
+__attribute__((unused)) int snapshot(void *addr, size_t bytes, int flags) {
+  ++snapshots;
+  if (nopMsync) [[unlikely]] {
+    DBGH(1) << "!!! Nop msync !!!\n";
+    return 0;
+  }
+
+#if defined(NO_PERSIST_OPS) || defined(NO_CHECK_MEMORY)
+  DBGH(1) << "!!! No persist ops !!!\n";
+  return 0;
+#endif
+
+#ifdef CXLBUF_TESTING_GOODIES
+  perst_overhead_clk->tick();
+#endif
+
+#ifdef TRACE_LOG_MSYNC
+  const std::string snapshot_msg = "snapshot\n";
+  write(trace_fd, snapshot_msg.c_str(), strlen(snapshot_msg.c_str()));
+#endif
+
+  auto pm_back = RCast<uint8_t *>(cxlbuf::backing_file_start);
+
+  if (storeInstEnabled) [[likely]] {
+    if ((flags & MS_FORCE_SNAPSHOT) and !storeInstEnabled) {
+      DBGE << "MS_FORCE_SNAPSHOT called with no sign of instrumentation\n";
+      exit(1);
+    }
+
+    DBGH(1) << "Call to snapshot(" << addr << ", " << bytes << ", " << flags
+            << ")\n";
+    if (firstSnapshot) [[unlikely]] {
+      sync_backing_files(addr);
+    }
+
+    if (flags & MS_SNAPSHOT_ALL) {
+      cxlbuf::for_each_tls_log([&](cxlbuf::Log &tls_log) {
+        snapshot_log(tls_log, addr, bytes, pm_back);
+      });
+    } else if (groupCommit and not local_log.held_by_owner()) {
+      /* An early snapshot from inside an append commits alone, the group
+         leader would wait for the log the thread holds */
+      group_snapshot(addr, bytes, pm_back);
+    } else {
+      snapshot_log(local_log, addr, bytes, pm_back);
     }
   } else {
     DBGH(1) << "Calling real msync" << std::endl;
@@ -576,7 +734,8 @@ __attribute__((unused)) int snapshot(void *addr, size_t bytes, int flags) {
 
     void *pg_aligned = (void *)(((size_t)addr >> 12) << 12);
 
-    const int mret = real_msync(pg_aligned, bytes, flags);
+    const int mret = real_msync(pg_aligned, bytes,
+                                flags & ~(MS_FORCE_SNAPSHOT | MS_SNAPSHOT_ALL));
 
     if (-1 == mret) {
       DBGE << "msync(" << pg_aligned << ", " << bytes << ", " << flags << ")\n";
@@ -592,6 +751,47 @@ __attribute__((unused)) int snapshot(void *addr, size_t bytes, int flags) {
   return 0;
 }
 
+/**
+ * @details Needs a redo log build (LOG_REDO), an undo log can't be applied
+ * once the caller stores to the range again. Other builds snapshot()
+ * synchronously and return 0, the ticket of a durable snapshot.
+ */
+uint64_t snapshot_async(void *addr, size_t bytes) {
+#if defined(LOG_REDO) && !defined(NO_PERSIST_OPS) && !defined(NO_CHECK_MEMORY)
+  if (storeInstEnabled and not nopMsync) [[likely]] {
+    ++snapshots;
+
+    DBGH(1) << "Call to snapshot_async(" << addr << ", " << bytes << ")\n";
+    if (firstSnapshot) [[unlikely]] {
+      sync_backing_files(addr);
+    }
+
+    cxlbuf::Log::guard_t guard(local_log, true);
+    return local_log.commit_redo_async(
+        addr, bytes, RCast<uint8_t *>(cxlbuf::backing_file_start));
+  }
+#endif
+
+  snapshot(addr, bytes, MS_SYNC);
+  return 0;
+}
+
+int snapshot_wait(uint64_t ticket) {
+#ifdef LOG_REDO
+  if (ticket != 0) local_log.wait_committed(ticket);
+#endif
+
+  return 0;
+}
+
+bool snapshot_done(uint64_t ticket) {
+#ifdef LOG_REDO
+  return ticket == 0 or local_log.is_committed(ticket);
+#else
+  return true;
+#endif
+}
+
 int munmap(void *__addr, size_t __len) __THROW {
   DBGH(4) << "mumap intercepted\n";
   for (auto &range : cxlbuf::mapped_addr) {
@@ -6,11 +6,13 @@
 #include <sys/mman.h>
 
 #include "bgflush.hh"
+#include "census.hh"
 #include "common.hh"
 #include "libc_wrappers.hh"
 #include "libstoreinst.hh"
 #include "libvram/libvram.hh"
 #include "log.hh"
+#include "logarena.hh"
 #include "nvsl/clock.hh"
 #include "nvsl/common.hh"
 #include "nvsl/envvars.hh"
@@ -25,13 +27,31 @@ NVSL_DECL_ENV(PMEM_START_ADDR);
 NVSL_DECL_ENV(CXLBUF_MSYNC_IS_NOP);
 NVSL_DECL_ENV(CXLBUF_MSYNC_SLEEP_NS);
 NVSL_DECL_ENV(CXLBUF_LOG_LOC);
+NVSL_DECL_ENV(CXLBUF_LIBC_NO_LOG);
+NVSL_DECL_ENV(CXLBUF_LOG_NO_DEDUP);
+NVSL_DECL_ENV(CXLBUF_LOG_NT_STORE);
+NVSL_DECL_ENV(CXLBUF_LOG_SIZE_MIB);
+NVSL_DECL_ENV(CXLBUF_LOG_SLOTS);
+NVSL_DECL_ENV(CXLBUF_APPLY_THREADS);
+NVSL_DECL_ENV(CXLBUF_APPLY_NODE);
+NVSL_DECL_ENV(CXLBUF_GROUP_COMMIT);
+NVSL_DECL_ENV(CXLBUF_GROUP_WAIT_NS);
 
 #define TRACE_FILE "/tmp/cxlbuf.trace"
 
 bool firstSnapshot = true;
 bool crashOnCommit = false;
 bool nopMsync = false;
+bool libcLogging = true;
+bool logDedup = true;
+bool logNtStore = false;
 size_t msyncSleepNs = 0;
+size_t logCapacity = nvsl::cxlbuf::Log::BUF_SZ;
+size_t logSlots = nvsl::cxlbuf::arena::DEFAULT_SLOTS;
+size_t applyThreads = 0;
+int applyNode = -1;
+bool groupCommit = false;
+size_t groupWaitNs = 0;
 int trace_fd = -1;
 
 namespace nvsl {
@@ -56,7 +76,6 @@ void init_counters() {
   c::total_bytes_wr_strm = new nvsl::StatsScalar();
   c::total_bytes_flushed = new nvsl::StatsScalar();
 
-  c::back_to_back_dup_log = new nvsl::Counter();
   c::total_pers_log_entries = new nvsl::Counter();
   c::total_log_entries = new nvsl::Counter();
   c::skip_check_count = new nvsl::Counter();
@@ -64,23 +83,35 @@ void init_counters() {
   c::logged_check_count = new nvsl::Counter();
   c::tx_log_count_dist = new nvsl::StatsFreq<>();
   c::mergeable_entries = new nvsl::Counter();
+  c::unprofiled_hits = new nvsl::Counter();
+  c::deduped_log_entries = new nvsl::Counter();
+  c::overflow_snapshots = new nvsl::Counter();
+  c::group_commits = new nvsl::Counter();
 
   c::total_pers_log_entries->init("total_pers_log_entries",
                                   "Total log entries actually persisted");
-  c::mergeable_entries->init("mergeable_entries",
-                             "Mergeable entries in the log on snapshot()");
+  c::mergeable_entries->init(
+      "mergeable_entries",
+      "Logged ranges merged into an overlapping or adjacent one");
   c::total_log_entries->init("total_log_entries",
                              "Total log entries (log_range calls)");
   c::skip_check_count->init("skip_check_count", "Skipped memory checks");
-  c::dup_log_entries->init("dup_log_entries", "Duplicate log entries");
+  c::dup_log_entries->init(
+      "dup_log_entries", "Logged ranges already covered in the current epoch");
   c::logged_check_count->init("logged_check_count", "Logged memory checks");
+  c::unprofiled_hits->init(
+      "unprofiled_hits",
+      "Logged stores from sites the census never saw (stale profile)");
+  c::deduped_log_entries->init(
+      "deduped_log_entries",
+      "log_range calls whose cachelines were all already logged this epoch");
+  c::overflow_snapshots->init(
+      "overflow_snapshots", "Early snapshots taken because a log was full");
+  c::group_commits->init(
+      "group_commits", "Group commits, each covering one or more snapshots");
   c::tx_log_count_dist->init("tx_log_count_dist",
                              "Distribution of number of logs in a transaction",
                              5, 0, 30);
-
-  c::back_to_back_dup_log->init(
-      "back_to_back_dup_log",
-      "Back-to-back duplicate log entries on call to log_range()");
   c::total_bytes_wr->init("total_bytes_wr",
                           "Total bytes written across snapshots");
   c::total_bytes_wr_strm->init(
@@ -121,6 +152,10 @@ void init_pmemops() {
 void init_envvars() {
   crashOnCommit = get_env_val(CXLBUF_CRASH_ON_COMMIT_ENV);
   nopMsync = get_env_val(CXLBUF_MSYNC_IS_NOP_ENV);
+  libcLogging = not get_env_val(CXLBUF_LIBC_NO_LOG_ENV);
+  logDedup = not get_env_val(CXLBUF_LOG_NO_DEDUP_ENV);
+  logNtStore = get_env_val(CXLBUF_LOG_NT_STORE_ENV);
+  groupCommit = get_env_val(CXLBUF_GROUP_COMMIT_ENV);
   nvsl::cxlbuf::log_loc = new std::string(
       get_env_str(CXLBUF_LOG_LOC_ENV, "/mnt/pmem0/cxlbuf_logs/"));
 
@@ -131,8 +166,57 @@ void init_envvars() {
     msyncSleepNs = 0;
   }
 
+  const auto logSizeMibStr = get_env_str(CXLBUF_LOG_SIZE_MIB_ENV);
+  if (logSizeMibStr != "") {
+    try {
+      logCapacity = std::stoull(logSizeMibStr) * 1024 * 1024;
+    } catch (const std::exception &e) {
+      DBGE << "Invalid CXLBUF_LOG_SIZE_MIB: " << logSizeMibStr << std::endl;
+      exit(1);
+    }
+  }
+
+  const auto logSlotsStr = get_env_str(CXLBUF_LOG_SLOTS_ENV);
+  if (logSlotsStr != "") {
+    try {
+      logSlots = std::stoull(logSlotsStr);
+    } catch (const std::exception &e) {
+      DBGE << "Invalid CXLBUF_LOG_SLOTS: " << logSlotsStr << std::endl;
+      exit(1);
+    }
+  }
+
+  const auto applyThreadsStr = get_env_str(CXLBUF_APPLY_THREADS_ENV);
+  const auto applyNodeStr = get_env_str(CXLBUF_APPLY_NODE_ENV);
+  try {
+    if (applyThreadsStr != "") applyThreads = std::stoull(applyThreadsStr);
+    if (applyNodeStr != "") applyNode = std::stoi(applyNodeStr);
+  } catch (const std::exception &e) {
+    DBGE << "Invalid CXLBUF_APPLY_THREADS or CXLBUF_APPLY_NODE" << std::endl;
+    exit(1);
+  }
+
+  const auto groupWaitNsStr = get_env_str(CXLBUF_GROUP_WAIT_NS_ENV);
+  if (groupWaitNsStr != "") {
+    try {
+      groupWaitNs = std::stoull(groupWaitNsStr);
+    } catch (const std::exception &e) {
+      DBGE << "Invalid CXLBUF_GROUP_WAIT_NS: " << groupWaitNsStr << std::endl;
+      exit(1);
+    }
+  }
+
   std::cerr << "nopMsync = " << nopMsync << std::endl;
+  std::cerr << "libcLogging = " << libcLogging << std::endl;
+  std::cerr << "logDedup = " << logDedup << std::endl;
+  std::cerr << "logNtStore = " << logNtStore << std::endl;
   std::cerr << "msyncSleepNS = " << msyncSleepNs << std::endl;
+  std::cerr << "logCapacity = " << logCapacity << std::endl;
+  std::cerr << "logSlots = " << logSlots << std::endl;
+  std::cerr << "applyThreads = " << applyThreads << std::endl;
+  std::cerr << "applyNode = " << applyNode << std::endl;
+  std::cerr << "groupCommit = " << groupCommit << std::endl;
+  std::cerr << "groupWaitNs = " << groupWaitNs << std::endl;
 }
 
 void init_vram() {
@@ -175,19 +259,139 @@ __attribute__((__constructor__(101))) void libstoreinst_ctor() {
 #endif
 }
 
-__attribute__((unused)) void checkMemory(void *ptr) {
+static inline void traceCheckMemory() {
+#ifndef RELEASE
+  if (get_env_val(ENABLE_CHECK_MEMORY_TRACING_ENV)) {
+    *traceStream << "-----\n" << nvsl::get_stack_trace() << "\n\n";
+  }
+#endif
+}
+
+/**
+ * @brief Log a store the instrumentation already found in the tracked range
+ * @details Cold path of the range check the storeinst pass emits inline, used
+ * for store sizes without a fixed-size entry point below
+ */
+__attribute__((unused, noinline)) void logMemory_n(void *ptr, size_t bytes) {
+#ifdef NO_CHECK_MEMORY
+  return;
+#endif
+
+  local_log.log_range(ptr, bytes);
+  traceCheckMemory();
+}
+
+/* Fixed-size variants of logMemory_n(), one per power-of-two store width */
+#ifdef NO_CHECK_MEMORY
+#define CXLBUF_DEF_LOG_MEMORY(N)                                               \
+  __attribute__((unused, noinline)) void logMemory_##N(void *ptr) { return; }
+#else
+#define CXLBUF_DEF_LOG_MEMORY(N)                                               \
+  __attribute__((unused, noinline)) void logMemory_##N(void *ptr) {            \
+    local_log.log_range<N>(ptr);                                               \
+    traceCheckMemory();                                                        \
+  }
+#endif
+
+CXLBUF_DEF_LOG_MEMORY(1)
+CXLBUF_DEF_LOG_MEMORY(2)
+CXLBUF_DEF_LOG_MEMORY(4)
+CXLBUF_DEF_LOG_MEMORY(8)
+CXLBUF_DEF_LOG_MEMORY(16)
+CXLBUF_DEF_LOG_MEMORY(32)
+CXLBUF_DEF_LOG_MEMORY(64)
+
+#undef CXLBUF_DEF_LOG_MEMORY
+
+/**
+ * @brief Log a store from a site that never hit the range in the census
+ * @details Only behind a range guard, so tracking still needs to be checked
+ */
+__attribute__((unused, noinline)) void logMemoryUnprofiled(void *ptr,
+                                                           size_t bytes) {
 #ifdef NO_CHECK_MEMORY
   return;
 #endif
 
   if (startTracking) {
-    if (start_addr <= ptr and ptr < end_addr) {
-      local_log.log_range(ptr, 8);
 #ifndef RELEASE
-      if (get_env_val(ENABLE_CHECK_MEMORY_TRACING_ENV)) {
-        *traceStream << "-----\n" << nvsl::get_stack_trace() << "\n\n";
-      }
+    ++*nvsl::cxlbuf::unprofiled_hits;
+#endif
+    logMemory_n(ptr, bytes);
+  }
+}
+
+/**
+ * @brief Log an atomic store, RMW or cmpxchg found in the tracked range
+ * @details Called right before the atomic operation, see Log::log_atomic()
+ */
+__attribute__((unused, noinline)) void logMemoryAtomic(void *ptr,
+                                                       size_t bytes) {
+#ifdef NO_CHECK_MEMORY
+  return;
 #endif
+
+  local_log.log_atomic(ptr, bytes);
+  traceCheckMemory();
+}
+
+/**
+ * @brief Log the lanes of a scatter that hit the tracked range
+ *
+ * @param ptrs Pointer of each of the @p lanes lanes
+ * @param hit_lanes Bitmask of the enabled lanes that hit the range
+ * @param elem_size Bytes each lane writes
+ *
+ * @details Runs of lanes writing adjacent elements are logged as a single
+ * entry, so a scatter that happens to be contiguous costs one entry.
+ */
+__attribute__((unused, noinline)) void
+logMemoryScatter(void *const *ptrs, uint64_t hit_lanes, size_t lanes,
+                 size_t elem_size) {
+#ifdef NO_CHECK_MEMORY
+  return;
+#endif
+
+  uint8_t *run_start = nullptr;
+  size_t run_bytes = 0;
+
+  for (size_t lane = 0; lane < lanes and lane < 64; lane++) {
+    if (not (hit_lanes & (1UL << lane))) continue;
+
+    auto *ptr = (uint8_t *)ptrs[lane];
+    if (run_start != nullptr and ptr == run_start + run_bytes) {
+      run_bytes += elem_size;
+      continue;
+    }
+
+    if (run_start != nullptr) local_log.log_range(run_start, run_bytes);
+    run_start = ptr;
+    run_bytes = elem_size;
+  }
+
+  if (run_start != nullptr) local_log.log_range(run_start, run_bytes);
+  traceCheckMemory();
+}
+
+/** @brief Called by census builds the first time a site hits the range */
+__attribute__((unused, noinline)) void censusHit(uint64_t site_id) {
+  nvsl::cxlbuf::census::record(site_id);
+}
+
+/** @brief Called on every hit of a site in builds with DCLANG_SITE_COUNTERS */
+__attribute__((unused, noinline)) void siteHit(uint64_t site_id,
+                                               size_t bytes) {
+  nvsl::cxlbuf::census::count(site_id, bytes);
+}
+
+__attribute__((unused)) void checkMemory(void *ptr) {
+#ifdef NO_CHECK_MEMORY
+  return;
+#endif
+
+  if (startTracking) {
+    if (start_addr <= ptr and ptr < end_addr) {
+      logMemory_8(ptr);
     } else {
 #ifdef CXLBUF_TESTING_GOODIES
       ++*nvsl::cxlbuf::skip_check_count;
@@ -200,12 +404,14 @@ __attribute__((destructor)) void libstoreinst_dtor() {
   namespace c = nvsl::cxlbuf;
 
   perst_overhead_clk->reconcile();
+  c::census::dump();
 
   std::cerr << "Summary:\n";
   std::cerr << "snapshots = " << snapshots.value() << std::endl;
   std::cerr << "real_msyncs = " << real_msyncs.value() << std::endl;
   std::cerr << c::skip_check_count->str() << "\n";
   std::cerr << c::logged_check_count->str() << "\n";
+  std::cerr << c::unprofiled_hits->str() << "\n";
   std::cerr << c::tx_log_count_dist->str() << "\n";
 
   std::cerr << c::mergeable_entries->str() << "\n";
@@ -215,7 +421,9 @@ __attribute__((destructor)) void libstoreinst_dtor() {
   std::cerr << c::total_bytes_wr_strm->str() << "\n";
   std::cerr << c::total_bytes_flushed->str() << "\n";
   std::cerr << c::dup_log_entries->str() << "\n";
-  std::cerr << c::back_to_back_dup_log->str() << "\n";
+  std::cerr << c::deduped_log_entries->str() << "\n";
+  std::cerr << c::overflow_snapshots->str() << "\n";
+  std::cerr << c::group_commits->str() << "\n";
   std::cerr << "perst_overhead = " << perst_overhead_clk->ns() << std::endl;
 }
 }
@@ -6,15 +6,21 @@
  * @brief  Brief description here
  */
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
 #include <dlfcn.h>
 #include <filesystem>
+#include <functional>
+#include <mutex>
 #include <thread>
 
 #include "bgflush.hh"
-#include "libcxlfs/libcxlfs.hh"
-#include "libvram/libvram.hh"
 #include "log.hh"
+#include "logarena.hh"
+#include "ntstore.hh"
 #include "nvsl/clock.hh"
 #include "nvsl/pmemops.hh"
 #include "nvsl/stats.hh"
@@ -25,21 +31,109 @@
     "Incompatible flags: LOG_FORMAT_VOLATILE and LOG_FORMAT_NON_VOLATILE enabled"
 #endif
 
+#if defined LOG_REDO && !defined LOG_FORMAT_VOLATILE
+#error "LOG_REDO records the ranges in the volatile list (LOG_FORMAT_VOLATILE)"
+#endif
+
 using namespace nvsl;
 
 Counter *cxlbuf::skip_check_count, *cxlbuf::logged_check_count,
-    *cxlbuf::dup_log_entries, *cxlbuf::back_to_back_dup_log,
-    *cxlbuf::total_log_entries, *cxlbuf::total_pers_log_entries,
-    *cxlbuf::mergeable_entries;
+    *cxlbuf::dup_log_entries, *cxlbuf::total_log_entries,
+    *cxlbuf::total_pers_log_entries,
+    *cxlbuf::mergeable_entries, *cxlbuf::unprofiled_hits,
+    *cxlbuf::deduped_log_entries, *cxlbuf::overflow_snapshots,
+    *cxlbuf::group_commits;
 StatsFreq<> *cxlbuf::tx_log_count_dist;
 StatsScalar *cxlbuf::total_bytes_wr, *cxlbuf::total_bytes_wr_strm,
     *nvsl::cxlbuf::total_bytes_flushed;
 
 extern nvsl::PMemOps *pmemops;
 
-void cxlbuf::Log::log_range(void *start, size_t bytes) {
+static_assert(offsetof(cxlbuf::Log::log_layout_t, content) % 64 == 0,
+              "Log entries should start at a cacheline boundary");
+
+/**
+ * @details The header is staged together with the payload bytes that precede
+ * the first cacheline boundary, so the rest of the payload streams out in
+ * whole aligned lines. Only the lines at either end of the entry may hold
+ * cached bytes: the first is flushed here once the entry leaves it, the last
+ * one by a later entry or flush_all().
+ */
+void cxlbuf::Log::append_nt(void *start, size_t bytes) {
+  const size_t entry_off = log_area->log_offset;
+  uint8_t *dst = log_area->tail_ptr;
+
+  alignas(64) uint8_t head[16 + 64];
+  const size_t hdr_sz = entry_hdr_t::encode(head, (uint64_t)start, bytes);
+#ifdef LOG_CHECKSUM
+  entry_hdr_t::seal(head, start, log_area->epoch);
+#endif
+
+  const size_t staged =
+      std::min(bytes, (64 - (uintptr_t)(dst + hdr_sz) % 64) % 64);
+  real_memcpy(head + hdr_sz, start, staged);
+
+  stream_copy(dst, head, hdr_sz + staged);
+  stream_copy(dst + hdr_sz + staged, (uint8_t *)start + staged,
+              bytes - staged);
+
+  const size_t entry_sz = entry_hdr_t::entry_size(bytes);
+  log_area->log_offset += entry_sz;
+  log_area->tail_ptr += entry_sz;
+
+  const size_t first_cl = entry_off / 64;
+  const size_t end_cl = log_area->log_offset / 64;
+  if (first_cl != end_cl) {
+    if (entry_off % 64 != 0) {
+      pmemops->flush(log_area->content + first_cl * 64, 64);
+    }
+    last_flush_offset = end_cl * 64;
+  }
+}
+
+template <typename CopyFn>
+void cxlbuf::Log::append(void *start, size_t bytes, CopyFn copy) {
+  uint8_t *entry = log_area->tail_ptr;
+  const size_t entry_sz = entry_hdr_t::entry_size(bytes);
+  const size_t hdr_sz = entry_hdr_t::encode(entry, (uint64_t)start, bytes);
+
+  copy(entry + hdr_sz, start, bytes);
+#ifdef LOG_CHECKSUM
+  entry_hdr_t::seal(entry, entry + hdr_sz, log_area->epoch);
+#endif
+
+  log_area->log_offset += entry_sz;
+  log_area->tail_ptr += entry_sz;
+
+  DBGH(4) << "Entry size = " << entry_sz << " bytes."
+          << " address = " << (void *)start
+          << " last_flush_offset = " << last_flush_offset
+          << " log_area->log_offset = " << log_area->log_offset
+          << " content bytes = " << bytes << std::endl;
+
+  if (bytes == 8) {
+    DBGH(4) << "Logged value = " << (void *)(*(uint64_t *)start) << std::endl;
+  }
+
+  /* Entries start at a cacheline boundary, so flush every line the log now
+     fills completely. The partially written last line is flushed with a
+     later entry or on snapshot */
+  const size_t full_off = log_area->log_offset / 64 * 64;
+  if (full_off > last_flush_offset) {
+    DBGH(4) << "Flushing " << (full_off - last_flush_offset) / 64
+            << " cachelines starting at "
+            << (void *)(log_area->content + last_flush_offset) << std::endl;
+
+    pmemops->flush(log_area->content + last_flush_offset,
+                   full_off - last_flush_offset);
+    last_flush_offset = full_off;
+  }
+}
+
+template <typename CopyFn>
+void cxlbuf::Log::log_range_internal(void *start, size_t bytes, CopyFn copy,
+                                     bool may_stream) {
   auto cxlModeEnabled_reg = cxlModeEnabled;
-  auto &log_entry = *RCast<log_entry_t *>(log_area->tail_ptr);
 
 #ifdef NO_PERSIST_OPS
   return;
@@ -66,63 +160,47 @@ void cxlbuf::Log::log_range(void *start, size_t bytes) {
     ++(*total_log_entries);
 #endif
 
+    const size_t entry_sz = entry_hdr_t::entry_size(bytes);
+
 #ifdef LOG_FORMAT_VOLATILE
-    /* Update the volatile address list */
-    this->entries.emplace_back((size_t)start, bytes);
-    if ((this->last_log.addr == this->entries.back().addr) and
-        (this->last_log.bytes == this->entries.back().bytes)) {
-      ++(*back_to_back_dup_log);
+    /* Update the volatile index first: the old value of a range it already
+       covers is in the log, and a covered range must not trigger an overflow
+       snapshot. */
+    const auto inserted = this->entries.insert((uint64_t)start, bytes);
+    if (inserted == range_set_t::COVERED) {
+#ifndef RELEASE
+      ++(*dup_log_entries);
+#endif
       return;
     }
 
-    this->last_log = this->entries.back();
+#ifndef RELEASE
+    if (inserted == range_set_t::MERGED) ++(*mergeable_entries);
 #endif
 
-    /* Write to the persistent log and flush and fence it */
-    log_entry.addr = (uint64_t)start;
-    log_entry.bytes = bytes;
-
-    real_memcpy(&log_entry.content, start, bytes);
-
-    const size_t entry_sz = sizeof(log_entry_t) + bytes;
-    log_area->log_offset += entry_sz;
-    log_area->tail_ptr += entry_sz;
-
-    const size_t cls_to_flush =
-        (log_area->log_offset - last_flush_offset + 63) / 64;
+    /* The overflow snapshot emptied the index, start the new epoch with this
+       range */
+    if (make_room(entry_sz)) this->entries.insert((uint64_t)start, bytes);
+#else
+    make_room(entry_sz);
+#endif
 
-    DBGH(4) << "Entry size = " << entry_sz << " bytes."
-            << " address = " << (void *)start
-            << " last_flush_offset = " << last_flush_offset
-            << " log_area->log_offset = " << log_area->log_offset
-            << " content bytes = " << bytes << std::endl;
+#ifdef LOG_REDO
+    /* Only the range is recorded, commit_redo() writes its new value */
+    redo_pending += entry_sz;
+    return;
+#endif
 
-    if (bytes == 8) {
-      DBGH(4) << "Old value = " << (void *)(*(uint64_t *)start) << std::endl;
+    if (logNtStore and may_stream) {
+      append_nt(start, bytes);
+#ifndef RELEASE
+      ++*logged_check_count;
+#endif
+      return;
     }
 
-    /* Flush all the lines only if the current entry ends at a cacheline
-       boundary */
-    if (log_area->log_offset % 64 == 0) {
-      DBGH(4) << "[1] Flushing " << cls_to_flush << " cachelines starting at "
-              << (void *)((char *)log_area + last_flush_offset) << std::endl;
-
-      pmemops->flush((char *)log_area + last_flush_offset, cls_to_flush * 64);
-
-      last_flush_offset = log_area->log_offset;
-    } else {
-      if (cls_to_flush > 1) {
-        DBGH(4) << "[2] Flushing " << cls_to_flush - 1
-                << " cachelines starting at "
-                << (void *)((char *)log_area + last_flush_offset) << std::endl;
-
-        /* FLush all but the last cacheline. Last (partially written) cacheline
-         * will be flushed with the next entry or on snapshot */
-        pmemops->flush(RCast<uint8_t *>(log_area) + last_flush_offset,
-                       (cls_to_flush - 1) * 64);
-        last_flush_offset += (cls_to_flush - 1) * 64;
-      }
-    }
+    /* Write to the persistent log and flush it */
+    append(start, bytes, copy);
 
 #ifndef RELEASE
     ++*logged_check_count;
@@ -142,9 +220,397 @@ void cxlbuf::Log::log_range(void *start, size_t bytes) {
   }
 }
 
+/**
+ * @details Each line's filter entry is a byte mask: only the requested bytes
+ * that aren't set in it yet are logged, then they are set. A later write to
+ * other bytes of the same line is still logged, and no entry holds bytes
+ * outside the request. Missing bytes are logged in runs across lines, so a
+ * contiguous range of new bytes is still one entry.
+ */
+void cxlbuf::Log::log_new_lines(void *start, size_t bytes) {
+  const uint64_t begin = (uint64_t)start;
+  const uint64_t end = begin + bytes;
+
+  /* Pending run of unlogged bytes, extended across line boundaries */
+  uint64_t run_start = 0, run_end = 0;
+  bool logged_any = false;
+
+  const auto log_run = [&]() {
+    if (run_start == run_end) return;
+    log_range_internal((void *)run_start, run_end - run_start, real_memcpy);
+    logged_any = true;
+  };
+
+  for (uint64_t line = begin / 64; line <= (end - 1) / 64; line++) {
+    const uint64_t base = line * 64;
+    const uint64_t want = line_filter_t::byte_mask(
+        std::max(begin, base) - base, std::min(end, base + 64) - base);
+    uint64_t missing = want & ~logged_lines.logged(line);
+
+    logged_lines.insert(line, want);
+
+    while (missing != 0) {
+      const size_t lo = __builtin_ctzl(missing);
+      const uint64_t rest = missing >> lo;
+      const size_t len = rest == ~0UL ? 64 : __builtin_ctzl(~rest);
+
+      if (base + lo != run_end) {
+        log_run();
+        run_start = base + lo;
+      }
+      run_end = base + lo + len;
+      missing &= ~line_filter_t::byte_mask(lo, lo + len);
+    }
+  }
+
+  log_run();
+
+#ifndef RELEASE
+  if (not logged_any) ++(*deduped_log_entries);
+#else
+  (void)logged_any;
+#endif
+}
+
+void cxlbuf::Log::log_range(void *start, size_t bytes) {
+  auto *start_u8 = RCast<uint8_t *>(start);
+
+  /* Dynamic lengths from memset/memcpy can be zero, nothing to log */
+  if (bytes == 0) [[unlikely]] return;
+
+  guard_t guard(*this, true);
+
+  if (logDedup and bytes <= MAX_DEDUP_SZ) [[likely]] {
+    log_new_lines(start, bytes);
+    return;
+  }
+
+  /* Small logs also split smaller, so that an entry always fits after an
+     overflow snapshot */
+  const size_t max_entry_sz = std::min(MAX_ENTRY_SZ, capacity / 4);
+
+  while (bytes > max_entry_sz) {
+    log_range_internal(start_u8, max_entry_sz, real_memcpy);
+    start_u8 += max_entry_sz;
+    bytes -= max_entry_sz;
+  }
+
+  log_range_internal(start_u8, bytes, real_memcpy);
+}
+
+template <size_t BYTES>
+void cxlbuf::Log::log_range(void *start) {
+  guard_t guard(*this, true);
+
+  if (logDedup) [[likely]] {
+    log_new_lines(start, BYTES);
+    return;
+  }
+
+  log_range_internal(start, BYTES, [](void *dst, const void *src, size_t) {
+    __builtin_memcpy(dst, src, BYTES);
+  });
+}
+
+template void cxlbuf::Log::log_range<1>(void *start);
+template void cxlbuf::Log::log_range<2>(void *start);
+template void cxlbuf::Log::log_range<4>(void *start);
+template void cxlbuf::Log::log_range<8>(void *start);
+template void cxlbuf::Log::log_range<16>(void *start);
+template void cxlbuf::Log::log_range<32>(void *start);
+template void cxlbuf::Log::log_range<64>(void *start);
+
+/**
+ * @details Reads the old value with relaxed atomic loads of the operation's
+ * width (other threads may be updating the location), then makes the entry
+ * durable and release-fences before returning. The entry is therefore
+ * persistent before the atomic executes and visible to any thread that
+ * synchronizes with it. Only the owner appends to the log, but the guard is
+ * still taken against the threads that drain it (MS_SNAPSHOT_ALL, the group
+ * commit leader).
+ */
+void cxlbuf::Log::log_atomic(void *start, size_t bytes) {
+  guard_t guard(*this, true);
+
+  make_room(entry_hdr_t::entry_size(bytes));
+  const uint8_t *entry_start = log_area->tail_ptr;
+
+  /* Skip if the atomic's bytes are already logged. They aren't marked here,
+     the filter only tracks plain stores. */
+  const uint64_t line = (uint64_t)start / 64;
+  const size_t lo = (uint64_t)start % 64;
+  const uint64_t want =
+      lo + bytes <= 64 ? line_filter_t::byte_mask(lo, lo + bytes) : 0;
+  if (logDedup and want != 0 and (logged_lines.logged(line) & want) == want) {
+#ifndef RELEASE
+    ++(*deduped_log_entries);
+#endif
+    std::atomic_thread_fence(std::memory_order_release);
+    return;
+  }
+
+  log_range_internal(start, bytes, [](void *dst, const void *src, size_t sz) {
+    switch (sz) {
+    case 1:
+      *(uint8_t *)dst =
+          __atomic_load_n((const uint8_t *)src, __ATOMIC_RELAXED);
+      break;
+    case 2:
+      *(uint16_t *)dst =
+          __atomic_load_n((const uint16_t *)src, __ATOMIC_RELAXED);
+      break;
+    case 4:
+      *(uint32_t *)dst =
+          __atomic_load_n((const uint32_t *)src, __ATOMIC_RELAXED);
+      break;
+    case 8:
+      *(uint64_t *)dst =
+          __atomic_load_n((const uint64_t *)src, __ATOMIC_RELAXED);
+      break;
+    case 16:
+      /* No untorn 16 byte load without a lock, each half is untorn */
+      ((uint64_t *)dst)[0] =
+          __atomic_load_n((const uint64_t *)src, __ATOMIC_RELAXED);
+      ((uint64_t *)dst)[1] =
+          __atomic_load_n((const uint64_t *)src + 1, __ATOMIC_RELAXED);
+      break;
+    default:
+      real_memcpy(dst, src, sz);
+    }
+  }, false);
+
+  if (log_area->tail_ptr != entry_start) {
+    pmemops->flush((void *)entry_start, log_area->tail_ptr - entry_start);
+    pmemops->drain();
+  }
+
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+/**
+ * @details The transaction in progress is committed early: everything logged
+ * so far is made durable in the backing file and the log is emptied. A crash
+ * after this point rolls back only to here, so capacity should be sized for
+ * the application's largest transaction when atomicity matters.
+ */
+void cxlbuf::Log::overflow_snapshot() {
+#ifndef RELEASE
+  ++(*overflow_snapshots);
+#endif
+
+  DBGH(1) << "Log full (" << pending_bytes() << " of " << capacity
+          << " bytes), snapshotting early" << std::endl;
+
+  snapshot(start_addr, (uint8_t *)end_addr - (uint8_t *)start_addr, 0);
+
+  /* snapshot() is a nop with CXLBUF_MSYNC_IS_NOP, the log is still dropped */
+  if (pending_bytes() != 0) drop();
+}
+
+void cxlbuf::Log::drop() {
+#ifdef LOG_REDO
+  reset_redo();
+#else
+  clear();
+#endif
+}
+
+#ifdef LOG_REDO
+/** @brief A log waiting for the applier */
+struct redo_job_t {
+  cxlbuf::Log::log_layout_t *log;
+  uint8_t *backing;
+
+  /** @brief Set to @p ticket once the log is COMMITTED, nullptr if the log
+   * already is */
+  std::atomic<uint64_t> *committed;
+  uint64_t ticket;
+};
+
+/* Never destroyed, the detached applier still waits on them at exit */
+
+/** @brief Logs waiting for the applier, in commit_seq order */
+static auto *redo_queue = new std::deque<redo_job_t>;
+static auto *redo_mutex = new std::mutex;
+static auto *redo_cv = new std::condition_variable;
+static bool redo_applier_started = false;
+
+/** @brief Last commit_seq fill_redo() stamped a log with */
+static std::atomic<uint64_t> last_commit_seq = 0;
+
+/** @brief commit_seq of the last log applied, under redo_mutex */
+static uint64_t applied_seq = 0;
+
+/**
+ * @details A single applier keeps the commit order across threads: a range
+ * two threads commit is left with the value of the later commit. Logs are
+ * applied by increasing commit_seq, the order recovery replays them in, so
+ * the applier waits for a log that was stamped but not queued yet. Nothing
+ * can then be queued ahead of the log being applied.
+ */
+static void redo_applier() {
+  std::unique_lock<std::mutex> lock(*redo_mutex);
+
+  while (true) {
+    redo_cv->wait(lock, [] {
+      return not redo_queue->empty() and
+             redo_queue->front().log->commit_seq == applied_seq + 1;
+    });
+
+    const auto job = redo_queue->front();
+    lock.unlock();
+
+    if (job.committed != nullptr) {
+      cxlbuf::Log::persist_redo(job.log);
+
+      lock.lock();
+      job.committed->store(job.ticket);
+      redo_cv->notify_all();
+      lock.unlock();
+    }
+
+    cxlbuf::Log::apply_redo(job.log, job.backing);
+    lock.lock();
+
+    applied_seq = job.log->commit_seq;
+    redo_queue->pop_front();
+    redo_cv->notify_all();
+  }
+}
+
+static void queue_redo(const redo_job_t &job) {
+  std::lock_guard<std::mutex> lock(*redo_mutex);
+
+  if (not redo_applier_started) {
+    std::thread(redo_applier).detach();
+    redo_applier_started = true;
+  }
+
+  const auto pos = std::upper_bound(
+      redo_queue->begin(), redo_queue->end(), job,
+      [](const redo_job_t &a, const redo_job_t &b) {
+        return a.log->commit_seq < b.log->commit_seq;
+      });
+  redo_queue->insert(pos, job);
+  redo_cv->notify_all();
+}
+
+/**
+ * @details The epoch is bumped first so the entries left from the previous
+ * commit don't validate as part of this one. Every log stamped with a
+ * commit_seq here has to be queued, the applier waits for it.
+ */
+void cxlbuf::Log::fill_redo(void *addr, size_t bytes, bool nt) {
+  const uint64_t start = (uint64_t)addr;
+  const uint64_t end = start + bytes;
+
+  wait_applied();
+
+  log_area->epoch++;
+  log_area->log_offset = 0;
+  log_area->tail_ptr = RCast<uint8_t *>(log_area->content);
+  last_flush_offset = 0;
+
+  for (const auto &entry : entries) {
+    /* Entries straddling either end of the range still overlap it */
+    if (entry.addr >= end or entry.addr + entry.bytes <= start) continue;
+
+    /* Merged extents can outgrow an entry */
+    for (uint64_t off = 0; off < entry.bytes; off += MAX_ENTRY_SZ) {
+      auto *src = (void *)(entry.addr + off);
+      const size_t len = std::min(MAX_ENTRY_SZ, entry.bytes - off);
+
+      if (nt) {
+        append_nt(src, len);
+      } else {
+        append(src, len, real_memcpy);
+      }
+    }
+  }
+
+  log_area->commit_seq = ++last_commit_seq;
+}
+
+/**
+ * @details The log is durable before the state flips to COMMITTED, a crash
+ * before that finds an EMPTY log and the backing file as of the previous
+ * commit.
+ */
+void cxlbuf::Log::commit_redo(void *addr, size_t bytes, uint8_t *backing) {
+  fill_redo(addr, bytes, logNtStore);
+
+  flush_all();
+  pmemops->flush(log_area, sizeof(*log_area));
+  pmemops->drain();
+  set_state(State::COMMITTED);
+
+  reset_redo();
+
+  queue_redo({log_area, backing, nullptr, 0});
+}
+
+void cxlbuf::Log::apply_redo(log_layout_t *log, uint8_t *backing) {
+  for (const auto &entry : *log) {
+    auto *dst = backing + (entry.addr - (uint64_t)start_addr);
+
+    if (not stream_copy(dst, entry.content, entry.bytes)) {
+      pmemops->flush(dst, entry.bytes);
+    }
+  }
+  pmemops->drain();
+
+  const State empty = State(State::EMPTY | ((uint64_t)CUR_FORMAT << 32));
+  pmemops->streaming_wr(&log->state, &empty, sizeof(log->state));
+  pmemops->drain();
+}
+
+/**
+ * @details Regular stores only: streaming stores would need a fence on this
+ * thread, the applier's flushes and fence cover cached lines. A crash before
+ * the applier is done finds an EMPTY log, the snapshot is lost as if it was
+ * never taken.
+ */
+uint64_t cxlbuf::Log::commit_redo_async(void *addr, size_t bytes,
+                                        uint8_t *backing) {
+  fill_redo(addr, bytes, false);
+  reset_redo();
+
+  queue_redo({log_area, backing, &committed_ticket, ++sealed_ticket});
+  return sealed_ticket;
+}
+
+void cxlbuf::Log::persist_redo(log_layout_t *log) {
+  pmemops->flush(log->content, log->log_offset);
+  pmemops->flush(log, sizeof(*log));
+  pmemops->drain();
+
+  const State committed =
+      State(State::COMMITTED | ((uint64_t)CUR_FORMAT << 32));
+  pmemops->streaming_wr(&log->state, &committed, sizeof(log->state));
+  pmemops->drain();
+}
+
+void cxlbuf::Log::wait_committed(uint64_t ticket) const {
+  std::unique_lock<std::mutex> lock(*redo_mutex);
+
+  redo_cv->wait(lock, [&] { return is_committed(ticket); });
+}
+
+void cxlbuf::Log::wait_applied() const {
+  std::unique_lock<std::mutex> lock(*redo_mutex);
+
+  redo_cv->wait(lock, [this] {
+    return std::none_of(redo_queue->begin(), redo_queue->end(),
+                        [this](const auto &job) {
+                          return job.log == log_area;
+                        });
+  });
+}
+#endif // LOG_REDO
+
 void cxlbuf::Log::flush_all() const {
   if (this->last_flush_offset != this->log_area->log_offset) {
-    const void *start = (char *)log_area->content + last_flush_offset;
+    const void *start = log_area->content + last_flush_offset;
     const size_t len = this->log_area->log_offset - this->last_flush_offset;
 
     DBGH(3) << "Flushing unflushed " << len << " bytes" << std::endl;
@@ -197,51 +663,29 @@ void nvsl::cxlbuf::Log::init_dirs() {
 }
 
 void nvsl::cxlbuf::Log::init_thread_buf() {
-  const auto tid = pthread_self();
-  const auto pid = getpid();
-
-  const auto fname = S(pid) + "." + S(tid) + ".log";
-  const auto fpath = *log_loc + "/" + fname;
+  const auto [area, id, bytes] = arena::acquire();
+  log_area = area;
+  slot = id;
+  capacity = bytes;
 
-  if (std::filesystem::is_regular_file(fpath)) {
-    std::filesystem::remove_all(fpath);
-  }
-
-  DBGH(1) << "Creating buffer file " << fpath << std::endl;
-
-  const int fd = open(fpath.c_str(), O_CREAT | O_RDWR, 0666);
-
-  if (fd == -1) {
-    perror("fallocate for buffer failed");
-    exit(1);
-  }
-
-  if (-1 == fallocate(fd, 0, 0, BUF_SZ)) {
-    perror("fallocate for buffer failed");
-    exit(1);
-  }
-
-  if (is_prefix("/mnt/mss0/", *log_loc)) {
-    log_area = RCast<log_layout_t *>(nvsl::libcxlfs::malloc(BUF_SIZE));
-  } else if (is_prefix("/mnt/cxl0/", *log_loc)) {
-    log_area = RCast<log_layout_t *>(nvsl::libvram::malloc(BUF_SIZE));
-  } else {
-    log_area = RCast<log_layout_t *>(
-        real_mmap(nullptr, BUF_SIZE, PROT_READ | PROT_WRITE,
-                  MAP_SYNC | MAP_SHARED_VALIDATE, fd, 0));
-  }
-
-  if (log_area == (log_layout_t *)-1) {
-    perror("mmap for buffer failed");
-    exit(1);
-  }
+  DBGH(1) << "Using log slot " << slot << " (" << capacity << " bytes)"
+          << std::endl;
 
+  /* A recycled slot was left empty by its last thread */
   log_area->log_offset = 0;
   log_area->tail_ptr = RCast<uint8_t *>(log_area->content);
+  /* Tag the format, a crash before the first snapshot sees an empty log
+     either way */
+  log_area->state = State(State::EMPTY | ((uint64_t)CUR_FORMAT << 32));
+  log_area->mode = CUR_MODE;
+  log_area->commit_epoch = log_area->epoch - 1;
 
-  cxlbuf_reg_tls_log();
+  /* The header (with the slot_size arena::map() set) is durable before the
+     thread logs anything to the slot */
+  pmemops->flush(log_area, sizeof(*log_area));
+  pmemops->drain();
 
-  close(fd);
+  cxlbuf_reg_tls_log();
 }
 
 nvsl::cxlbuf::Log::Log() {
@@ -253,13 +697,79 @@ nvsl::cxlbuf::Log::Log() {
   this->init_thread_buf();
 }
 
+/**
+ * @details The main thread's log is only destroyed when the process exits and
+ * is left as is, like a crash would. Other threads leave the registry first,
+ * then persist their stores before the slot is reused.
+ */
+nvsl::cxlbuf::Log::~Log() {
+  if (log_area == nullptr or gettid() == getpid()) return;
+
+  /* MS_SNAPSHOT_ALL can't drain the log from here on */
+  cxlbuf_unreg_tls_log(this);
+
+  if (pending_bytes() != 0) {
+    DBGH(1) << "Thread exiting with " << pending_bytes()
+            << " bytes logged, snapshotting" << std::endl;
+
+    snapshot(start_addr, (uint8_t *)end_addr - (uint8_t *)start_addr, 0);
+
+    if (pending_bytes() != 0) {
+      drop();
+      pmemops->drain();
+    }
+  }
+
+#ifdef LOG_REDO
+  wait_applied();
+#endif
+
+  arena::release(slot);
+}
+
+/** @brief Entry of the registry of thread logs, entries are never freed and
+ * are reused once their log is gone */
+struct tls_log_node_t {
+  std::atomic<nvsl::cxlbuf::Log *> log;
+  tls_log_node_t *next;
+};
+
+static std::atomic<tls_log_node_t *> tls_log_head = nullptr;
+
+/** @brief Keeps logs from being unregistered while for_each_tls_log() visits
+ * them, never destroyed so exiting threads can still take it */
+static auto *tls_logs_mutex = new std::mutex;
+
+/**
+ * @details Lock-free: a free entry is claimed with a CAS, or a new one is
+ * pushed at the head of the list.
+ */
 void nvsl::cxlbuf::cxlbuf_reg_tls_log() {
-  if (not tls_logs) {
-    tls_logs = new std::vector<nvsl::cxlbuf::Log *>;
+  for (auto node = tls_log_head.load(); node != nullptr; node = node->next) {
+    Log *expected = nullptr;
+    if (node->log.compare_exchange_strong(expected, &local_log)) return;
+  }
+
+  auto node = new tls_log_node_t{&local_log, tls_log_head.load()};
+  while (not tls_log_head.compare_exchange_weak(node->next, node)) {
+  }
+}
+
+void nvsl::cxlbuf::cxlbuf_unreg_tls_log(Log *log) {
+  std::lock_guard<std::mutex> lock(*tls_logs_mutex);
+
+  for (auto node = tls_log_head.load(); node != nullptr; node = node->next) {
+    Log *expected = log;
+    if (node->log.compare_exchange_strong(expected, nullptr)) return;
   }
+}
+
+void nvsl::cxlbuf::for_each_tls_log(const std::function<void(Log &)> &fn) {
+  std::lock_guard<std::mutex> lock(*tls_logs_mutex);
 
-  tls_logs->push_back(&local_log);
+  for (auto node = tls_log_head.load(); node != nullptr; node = node->next) {
+    if (auto log = node->log.load()) fn(*log);
+  }
 }
 
 thread_local nvsl::cxlbuf::Log local_log;
-std::vector<nvsl::cxlbuf::Log *> *tls_logs = nullptr;
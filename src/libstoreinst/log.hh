@@ -8,9 +8,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <functional>
+#include <mutex>
 #include <numeric>
+#include <vector>
 
 #include "immintrin.h"
 #include "libc_wrappers.hh"
@@ -27,7 +33,48 @@ namespace nvsl {
     class Log {
     public:
       /**
-       * @brief struct for storing log in persistent memory
+       * @brief Log format version, stored in the upper half of the state word
+       *
+       * @details FORMAT_PACKED logs (from before the version existed, the
+       * upper half is 0) use log_entry_t entries from byte 24 of the layout.
+       * FORMAT_ALIGNED logs use entry_hdr_t entries from the first cacheline
+       * boundary. FORMAT_CHECKSUMMED logs (LOG_CHECKSUM builds) use 16 byte
+       * entry_hdr_t headers that carry a checksum, see entry_hdr_t::seal().
+       */
+      enum Format : uint32_t {
+        FORMAT_PACKED = 0,
+        FORMAT_ALIGNED = 1,
+        FORMAT_CHECKSUMMED = 2,
+      };
+
+#ifdef LOG_CHECKSUM
+      static constexpr const Format CUR_FORMAT = FORMAT_CHECKSUMMED;
+#else
+      static constexpr const Format CUR_FORMAT = FORMAT_ALIGNED;
+#endif
+
+      /**
+       * @brief What the entries hold, see log_layout_t::mode
+       *
+       * @details MODE_UNDO entries hold the old value and are written as the
+       * stores happen, recovery replays an interrupted snapshot's log in
+       * reverse. MODE_REDO entries (LOG_REDO builds) hold the new value and
+       * are written by snapshot(), recovery replays a COMMITTED log forward.
+       */
+      enum Mode : uint64_t {
+        MODE_UNDO = 0,
+        MODE_REDO = 1,
+      };
+
+#ifdef LOG_REDO
+      static constexpr const Mode CUR_MODE = MODE_REDO;
+#else
+      static constexpr const Mode CUR_MODE = MODE_UNDO;
+#endif
+
+      /**
+       * @brief FORMAT_PACKED entry: packed 10 byte header and an unaligned
+       * payload, only read by recovery now
        */
       struct log_entry_t {
         uint8_t disabled : 1;
@@ -39,6 +86,127 @@ namespace nvsl {
         NVSL_END_IGNORE_WPEDANTIC
       } __attribute__((packed));
 
+      /**
+       * @brief FORMAT_ALIGNED entry header
+       *
+       * @details One word: the entry kind in the top byte and the address in
+       * the low 56 bits. Inline kinds imply the payload size and the payload
+       * follows directly. A RUN is followed by a word with the size, it holds
+       * any other size and the runs of adjacent lines/records the runtime
+       * coalesces. Payloads are padded to 8 bytes so every header is aligned.
+       *
+       * In FORMAT_CHECKSUMMED logs every entry has the second word: the size
+       * in the low half and the checksum in the upper half.
+       */
+      struct entry_hdr_t {
+        enum Kind : uint8_t {
+          INLINE_8 = 1,
+          INLINE_16 = 2,
+          INLINE_32 = 3,
+          INLINE_64 = 4,
+          RUN = 5,
+        };
+
+        uint64_t word;
+
+        static constexpr const uint64_t ADDR_MASK = (1UL << 56) - 1;
+
+        /** @brief Largest payload an entry can describe */
+        static constexpr const uint64_t MAX_BYTES = 1UL << 23;
+
+        static Kind kind_for(size_t bytes) {
+          switch (bytes) {
+          case 8:  return INLINE_8;
+          case 16: return INLINE_16;
+          case 32: return INLINE_32;
+          case 64: return INLINE_64;
+          default: return RUN;
+          }
+        }
+
+        /** @brief Header bytes for a payload of @p bytes */
+        static size_t hdr_size(size_t bytes, Format format = CUR_FORMAT) {
+          return (format == FORMAT_CHECKSUMMED or kind_for(bytes) == RUN) ? 16
+                                                                          : 8;
+        }
+
+        /** @brief Total entry bytes for a payload of @p bytes */
+        static size_t entry_size(size_t bytes, Format format = CUR_FORMAT) {
+          return hdr_size(bytes, format) + ((bytes + 7) & ~7UL);
+        }
+
+        /**
+         * @brief Write the header for [addr, addr+bytes) at @p dst
+         * @details FORMAT_CHECKSUMMED headers are completed by seal()
+         */
+        static size_t encode(void *dst, uint64_t addr, size_t bytes,
+                             Format format = CUR_FORMAT) {
+          auto *words = (uint64_t *)dst;
+          const Kind kind = kind_for(bytes);
+          const size_t hdr_sz = hdr_size(bytes, format);
+
+          words[0] = ((uint64_t)kind << 56) | (addr & ADDR_MASK);
+          if (hdr_sz == 16) words[1] = bytes;
+
+          return hdr_sz;
+        }
+
+        /**
+         * @brief Checksum of an entry, seeded with the log's epoch so that
+         * entries left over from earlier epochs don't validate
+         */
+        static uint32_t checksum(uint64_t epoch, uint64_t word0, uint64_t bytes,
+                                 const void *payload) {
+          const auto mix = [](uint64_t h) {
+            h *= 0x9E3779B97F4A7C15UL;
+            return h ^ (h >> 29);
+          };
+
+          const auto *src = (const uint8_t *)payload;
+          uint64_t h = mix(mix(epoch ^ word0) ^ bytes);
+          size_t off = 0;
+
+          for (; off + 8 <= bytes; off += 8) {
+            uint64_t word;
+            std::memcpy(&word, src + off, 8);
+            h = mix(h ^ word);
+          }
+
+          if (off != bytes) {
+            uint64_t word = 0;
+            std::memcpy(&word, src + off, bytes - off);
+            h = mix(h ^ word);
+          }
+
+          return (uint32_t)(h ^ (h >> 32));
+        }
+
+        /**
+         * @brief Store the checksum of the encode()d FORMAT_CHECKSUMMED
+         * header at @p entry, for the old value at @p payload
+         */
+        static void seal(void *entry, const void *payload, uint64_t epoch) {
+          auto *words = (uint64_t *)entry;
+          const uint64_t bytes = words[1] & 0xffffffffUL;
+
+          const uint64_t sum = checksum(epoch, words[0], bytes, payload);
+
+          words[1] = bytes | (sum << 32);
+        }
+      };
+
+      /**
+       * @brief Decoded log entry, independent of the format
+       */
+      struct entry_view_t {
+        uint64_t addr;
+        uint64_t bytes;
+        const uint8_t *content;
+
+        /** @brief Bytes the entry takes in the log */
+        size_t size;
+      };
+
       /**
        * @brief lean struct for tracking logged address and size
        */
@@ -55,121 +223,524 @@ namespace nvsl {
 
       struct log_entry_iter;
 
+      /** @brief Offset of the entries in a FORMAT_PACKED layout */
+      static constexpr const size_t PACKED_CONTENT_OFF = 24;
+
       struct log_layout_t {
+        /** @brief State in the low half, Format in the upper half */
         State state;
         uint64_t log_offset;
         uint8_t *tail_ptr; /*<< Volatile use only, points to the tail entry */
 
+        /** @brief Seeds the FORMAT_CHECKSUMMED entry checksums, bumped when
+         * the log is cleared */
+        uint64_t epoch;
+
+        /** @brief Mode of the entries, only set in FORMAT_ALIGNED and later
+         * layouts (zero, i.e., MODE_UNDO, in logs from before it existed) */
+        Mode mode;
+
+        /** @brief Bytes of the arena slot holding the log, see logarena.hh */
+        uint64_t slot_size;
+
+        /** @brief Commit order of the redo logs of a process, recovery
+         * replays its COMMITTED slots oldest first (zero in older logs) */
+        uint64_t commit_seq;
+
+        /** @brief Epoch of the snapshot in progress, a FORMAT_CHECKSUMMED
+         * undo log only needs recovery while it matches epoch */
+        uint64_t commit_epoch;
+
         NVSL_BEGIN_IGNORE_WPEDANTIC
-        log_entry_t content[];
+        uint8_t content[] __attribute__((aligned(64)));
         NVSL_END_IGNORE_WPEDANTIC
 
+        State get_state() const { return State(state & 0xffffffffUL); }
+
+        Format format() const { return Format(state >> 32); }
+
+        bool is_redo() const {
+          return format() != FORMAT_PACKED and mode == MODE_REDO;
+        }
+
+        /** @brief First entry, where it is depends on the format */
+        const uint8_t *entries() const {
+          return format() == FORMAT_PACKED
+                     ? RCast<const uint8_t *>(this) + PACKED_CONTENT_OFF
+                     : content;
+        }
+
         /*-- Iterators --*/
         log_entry_iter begin() const { return this->cbegin(); }
 
         log_entry_iter end() const { return this->cend(); }
 
         const log_entry_iter cbegin() const {
-          auto *result = this->content;
-
-          DBGH(4) << "log_entry_iter from begin = " << (void *)(result)
+          DBGH(4) << "log_entry_iter from begin = " << (void *)entries()
                   << std::endl;
 
-          return log_entry_iter(result);
+          return log_entry_iter(entries(), format());
         }
 
         const log_entry_iter cend() const {
-          auto *byte_ptr = RCast<const uint8_t *>(this->content);
-          byte_ptr += this->log_offset;
+          return log_entry_iter(entries() + this->log_offset, format());
+        }
 
-          auto *last_entry = RCast<const log_entry_t *>(byte_ptr);
+        /**
+         * @brief End of the valid prefix of a FORMAT_CHECKSUMMED log
+         * @param map_sz Bytes of the log mapping, bounds the walk
+         * @details Stops at the first torn entry or entry from another epoch,
+         * log_offset isn't needed.
+         */
+        const log_entry_iter valid_end(size_t map_sz) const {
+          const uint8_t *pos = entries();
+          const uint8_t *limit = RCast<const uint8_t *>(this) + map_sz;
+
+          while (pos + 16 <= limit and is_valid(pos, limit, epoch)) {
+            pos += decode(pos, FORMAT_CHECKSUMMED).size;
+          }
+
+          return log_entry_iter(pos, format());
+        }
 
-          return log_entry_iter(last_entry);
+        /** @brief Entries recovery should replay, see valid_end() */
+        const log_entry_iter replay_end(size_t map_sz) const {
+          return format() == FORMAT_CHECKSUMMED ? valid_end(map_sz) : cend();
+        }
+
+        /** @brief Check if a crash left entries that need to be replayed */
+        bool needs_recovery(size_t map_sz) const {
+          if (is_redo()) return get_state() == COMMITTED;
+
+          if (format() == FORMAT_CHECKSUMMED) {
+            return commit_epoch == epoch and valid_end(map_sz) != cbegin();
+          }
+
+          return get_state() == ACTIVE;
         }
       };
 
+      /** @brief Decode the entry at @p ptr in a log of @p format */
+      static entry_view_t decode(const uint8_t *ptr, Format format) {
+        if (format == FORMAT_PACKED) {
+          const auto *entry = RCast<const log_entry_t *>(ptr);
+          return {entry->addr, entry->bytes,
+                  RCast<const uint8_t *>(entry->content),
+                  sizeof(log_entry_t) + entry->bytes};
+        }
+
+        const auto *words = RCast<const uint64_t *>(ptr);
+        const auto kind = entry_hdr_t::Kind(words[0] >> 56);
+        const uint64_t addr = words[0] & entry_hdr_t::ADDR_MASK;
+
+        uint64_t bytes;
+        switch (kind) {
+        case entry_hdr_t::INLINE_8:  bytes = 8; break;
+        case entry_hdr_t::INLINE_16: bytes = 16; break;
+        case entry_hdr_t::INLINE_32: bytes = 32; break;
+        case entry_hdr_t::INLINE_64: bytes = 64; break;
+        default:                     bytes = words[1] & 0xffffffffUL; break;
+        }
+
+        const size_t hdr_sz = entry_hdr_t::hdr_size(bytes, format);
+        return {addr, bytes, ptr + hdr_sz,
+                entry_hdr_t::entry_size(bytes, format)};
+      }
+
       /**
-       * @brief Log entry iterator
+       * @brief Check the FORMAT_CHECKSUMMED entry at @p ptr against its
+       * checksum and @p epoch, without reading past @p limit
+       */
+      static bool is_valid(const uint8_t *ptr, const uint8_t *limit,
+                           uint64_t epoch) {
+        const auto *words = RCast<const uint64_t *>(ptr);
+        const uint8_t kind = words[0] >> 56;
+        const uint64_t bytes = words[1] & 0xffffffffUL;
+
+        if (kind < entry_hdr_t::INLINE_8 or kind > entry_hdr_t::RUN or
+            bytes > entry_hdr_t::MAX_BYTES or
+            entry_hdr_t::kind_for(bytes) != kind) {
+          return false;
+        }
+
+        const auto view = decode(ptr, FORMAT_CHECKSUMMED);
+        if (ptr + view.size > limit) return false;
+
+        return (words[1] >> 32) ==
+               entry_hdr_t::checksum(epoch, words[0], bytes, view.content);
+      }
+
+      /**
+       * @brief Log entry iterator, yields decoded entries of either format
        */
       struct log_entry_iter {
         using iterator_category = std::forward_iterator_tag;
         using difference_type = std::ptrdiff_t;
-        using value_type = log_entry_t;
-        using pointer = const log_entry_t *;   // or also value_type*
-        using reference = const log_entry_t &; // or also value_type&
+        using value_type = entry_view_t;
+        using pointer = const entry_view_t *;
+        using reference = const entry_view_t &;
 
         friend bool operator==(const log_entry_iter &a,
                                const log_entry_iter &b) {
-          return a.entry == b.entry;
+          return a.pos == b.pos;
         }
 
         friend bool operator!=(const log_entry_iter &a,
                                const log_entry_iter &b) {
-          return a.entry != b.entry;
+          return a.pos != b.pos;
         }
 
-        log_entry_iter(const pointer entry) : entry(entry) {
+        log_entry_iter(const uint8_t *pos, Format format)
+            : pos(pos), format(format) {}
+
+        /** @brief Decoded on access, the end position holds no entry */
+        reference operator*() {
+          this->view = decode(pos, format);
+
 #ifndef RELEASE
-          DBGH(4) << "Creating a new log entry iter for entry with address "
-                  << (void *)(0UL + entry->addr) << " and content: \n"
-                  << buf_to_hexstr((char *)entry->content, entry->bytes)
-                  << "\n";
+          DBGH(4) << "Log entry at " << (void *)pos << " for address "
+                  << (void *)view.addr << " and content: \n"
+                  << buf_to_hexstr((char *)view.content, view.bytes) << "\n";
 #endif
-        }
 
-        reference operator*() const { return *entry; }
+          return this->view;
+        }
 
-        pointer operator->() { return entry; }
+        pointer operator->() { return &**this; }
 
         log_entry_iter &operator++() {
-          auto old_val = this->entry;
+          auto old_pos = this->pos;
 
-          auto new_ptr_ul = (size_t)(entry) + entry->bytes + sizeof(*entry);
-          this->entry = RCast<pointer>(new_ptr_ul);
-          // this->entry = (pointer)align_cl(RCast<pointer>(new_ptr_ul));
+          this->pos += decode(pos, format).size;
 
-          DBGH(4) << "Log entry incrementing from " << (void *)(old_val)
-                  << " to " << this->entry << std::endl;
+          DBGH(4) << "Log entry incrementing from " << (void *)(old_pos)
+                  << " to " << (void *)this->pos << std::endl;
 
           return *this;
         }
 
         log_entry_iter operator++(int) {
           log_entry_iter result = *this;
+          ++*this;
+          return result;
+        }
 
-          auto new_ptr_ul = (uint64_t)entry + entry->bytes;
-          this->entry = RCast<pointer>(new_ptr_ul);
+        /** @brief Offset of the current entry from @p base */
+        size_t offset_from(const uint8_t *base) const { return pos - base; }
 
-          return result;
+      private:
+        const uint8_t *pos;
+        Format format;
+        entry_view_t view = {};
+      };
+
+      /**
+       * @brief Bytes undo-logged in the current epoch (since the last
+       * snapshot), as a byte mask per cacheline
+       *
+       * @details Open-addressed with linear probing. Slots are tagged with the
+       * epoch that filled them, so starting a new epoch is O(1). Lookups give
+       * up after MAX_PROBES slots, a line that can't be inserted is simply
+       * logged again the next time. Only the bytes a store covers are marked,
+       * the rest of the line may belong to another thread.
+       */
+      class line_filter_t {
+      public:
+        static constexpr const size_t SLOTS = 4096;
+        static constexpr const size_t MAX_PROBES = 8;
+
+        line_filter_t() : slots(SLOTS) {}
+
+        /** @brief Mask of the bytes of cacheline number @p line logged this
+         * epoch, bit i for byte i */
+        uint64_t logged(uint64_t line) const {
+          for (size_t i = 0, s = hash(line); i < MAX_PROBES; i++, s++) {
+            const auto &slot = slots[s % SLOTS];
+            if (slot.epoch != epoch) return 0;
+            if (slot.line == line) return slot.mask;
+          }
+          return 0;
+        }
+
+        /** @brief Mark the bytes in @p mask of cacheline number @p line as
+         * logged, best effort */
+        void insert(uint64_t line, uint64_t mask) {
+          for (size_t i = 0, s = hash(line); i < MAX_PROBES; i++, s++) {
+            auto &slot = slots[s % SLOTS];
+            if (slot.epoch != epoch) {
+              slot = {line, mask, epoch};
+              return;
+            }
+            if (slot.line == line) {
+              slot.mask |= mask;
+              return;
+            }
+          }
+        }
+
+        /** @brief Mask of bytes [lo, hi) of a cacheline, 0 <= lo < hi <= 64 */
+        static uint64_t byte_mask(size_t lo, size_t hi) {
+          const uint64_t ones = hi - lo == 64 ? ~0UL : (1UL << (hi - lo)) - 1;
+          return ones << lo;
+        }
+
+        /** @brief Forget all the lines, called when the log is cleared */
+        void new_epoch() {
+          if (++epoch == 0) [[unlikely]] {
+            std::fill(slots.begin(), slots.end(), slot_t{0, 0, 0});
+            epoch = 1;
+          }
         }
 
       private:
-        pointer entry;
+        struct slot_t {
+          uint64_t line;
+          uint64_t mask;
+          uint32_t epoch;
+        };
+
+        static size_t hash(uint64_t line) {
+          return (line * 0x9E3779B97F4A7C15UL) >> 52;
+        }
+
+        std::vector<slot_t> slots;
+        uint32_t epoch = 1;
+      };
+
+      /**
+       * @brief Ranges logged in the current epoch, as sorted and disjoint
+       * extents
+       *
+       * @details Overlapping and adjacent ranges are merged as they are
+       * inserted, so snapshot() copies each contiguous dirty extent once.
+       * Stores mostly extend the extent the previous one touched, that is
+       * checked first without a search. Other inserts binary search the
+       * sorted vector and merge with their neighbours.
+       */
+      class range_set_t {
+      public:
+        enum insert_result_t {
+          INSERTED, /*<< Added as a new extent */
+          MERGED,   /*<< Merged into one or more extents */
+          COVERED,  /*<< Already covered, nothing changed */
+        };
+
+        insert_result_t insert(uint64_t addr, uint64_t bytes) {
+          const uint64_t end = addr + bytes;
+
+          /* Fast path: the range grows (or is in) the last extent touched
+             without reaching the next one */
+          if (last < extents.size()) {
+            auto &ext = extents[last];
+            const uint64_t ext_end = ext.addr + ext.bytes;
+            const bool before_next = last + 1 == extents.size() or
+                                     end < extents[last + 1].addr;
+
+            if (addr >= ext.addr and end <= ext_end) return COVERED;
+            if (addr >= ext.addr and addr <= ext_end and before_next) {
+              ext.bytes = end - ext.addr;
+              return MERGED;
+            }
+          }
+
+          /* First extent that ends at or after addr, i.e., the first one the
+             range can touch */
+          auto it = std::lower_bound(
+              extents.begin(), extents.end(), addr,
+              [](const log_entry_lean_t &ext, uint64_t a) {
+                return ext.addr + ext.bytes < a;
+              });
+
+          if (it == extents.end() or it->addr > end) {
+            last = extents.insert(it, {addr, bytes}) - extents.begin();
+            return INSERTED;
+          }
+
+          last = it - extents.begin();
+          if (it->addr <= addr and it->addr + it->bytes >= end) {
+            return COVERED;
+          }
+
+          const uint64_t new_start = std::min(it->addr, addr);
+          uint64_t new_end = std::max(it->addr + it->bytes, end);
+
+          auto next = it + 1;
+          for (; next != extents.end() and next->addr <= new_end; ++next) {
+            new_end = std::max(new_end, next->addr + next->bytes);
+          }
+
+          *it = {new_start, new_end - new_start};
+          extents.erase(it + 1, next);
+          return MERGED;
+        }
+
+        void clear() {
+          extents.clear();
+          last = 0;
+        }
+
+        void reserve(size_t n) { extents.reserve(n); }
+
+        size_t size() const { return extents.size(); }
+
+        bool empty() const { return extents.empty(); }
+
+        std::vector<log_entry_lean_t>::const_iterator begin() const {
+          return extents.begin();
+        }
+
+        std::vector<log_entry_lean_t>::const_iterator end() const {
+          return extents.end();
+        }
+
+      private:
+        std::vector<log_entry_lean_t> extents;
+
+        /** @brief Extent the last insert touched */
+        size_t last = 0;
       };
 
     private:
-      log_entry_lean_t last_log = {0};
+      /** @brief See guard_t */
+      std::mutex mutex;
+
+      /** @brief Set while the owner holds mutex, only accessed by the owner */
+      bool owner_holds = false;
+
       size_t last_flush_offset = 0;
+      line_filter_t logged_lines;
+
+      /** @brief Arena slot holding log_area */
+      size_t slot = 0;
 
       void init_dirs();
 
-      /** @brief initialize and map this thread's log buffer */
+      /** @brief Take an arena slot for this thread's log buffer */
       void init_thread_buf();
 
+      /**
+       * @brief Append an undo entry, copying the old value using @p copy
+       * @param may_stream Use append_nt() if enabled, @p copy is ignored then
+       */
+      template <typename CopyFn>
+      void log_range_internal(void *start, size_t bytes, CopyFn copy,
+                              bool may_stream = true);
+
+      /**
+       * @brief Write the entry for [start, start+bytes) at the tail with
+       * streaming stores, see stream_copy()
+       */
+      void append_nt(void *start, size_t bytes);
+
+      /**
+       * @brief Log the bytes of [start, start+bytes) that weren't logged this
+       * epoch
+       *
+       * @details The filter is looked up a cacheline at a time, but entries
+       * only ever hold bytes inside the request: snapshot() and undo replay
+       * must not write bytes of the line that another thread owns.
+       */
+      void log_new_lines(void *start, size_t bytes);
+
+      /**
+       * @brief Write the entry for [start, start+bytes) at the tail, copying
+       * the value using @p copy, and flush the lines it fills
+       */
+      template <typename CopyFn>
+      void append(void *start, size_t bytes, CopyFn copy);
+
+      /** @brief Snapshot the whole tracked range to empty a full log */
+      void overflow_snapshot();
+
+      /** @brief Drop the entries of the current epoch without applying them
+       */
+      void drop();
+
+#ifdef LOG_REDO
+      /** @brief Log bytes the ranges recorded this epoch will take once
+       * commit_redo() writes them */
+      size_t redo_pending = 0;
+
+      /** @brief Forget the ranges recorded this epoch */
+      void reset_redo() {
+        redo_pending = 0;
+        logged_lines.new_epoch();
+        entries.clear();
+      }
+
+      /** @brief Last ticket commit_redo_async() handed out */
+      uint64_t sealed_ticket = 0;
+
+      /** @brief Last ticket whose log is COMMITTED, set by the applier */
+      std::atomic<uint64_t> committed_ticket = 0;
+
+      /**
+       * @brief Wait for the previous commit to be applied and write the new
+       * value of every range recorded in [addr, addr+bytes) to the log
+       * @param nt Use streaming stores, the caller has to drain them
+       */
+      void fill_redo(void *addr, size_t bytes, bool nt);
+#endif
+
+      /** @brief Bytes the current epoch takes (or will take) in the log */
+      size_t pending_bytes() const {
+#ifdef LOG_REDO
+        return redo_pending;
+#else
+        return log_area->log_offset;
+#endif
+      }
+
+      /**
+       * @brief Make sure an entry of @p entry_sz bytes fits in the log,
+       * snapshotting early if it doesn't
+       * @details Call before taking any pointer to the log tail.
+       * @return True if the log was snapshotted (and emptied) to make room
+       */
+      bool make_room(size_t entry_sz) {
+        if (pending_bytes() + entry_sz > capacity) [[unlikely]] {
+          overflow_snapshot();
+          return true;
+        }
+        return false;
+      }
+
     public:
       static constexpr const size_t MAX_ENTRIES = 1024;
+
+      /** @brief Default log capacity, see CXLBUF_LOG_SIZE_MIB */
       static constexpr const size_t BUF_SZ = 128 * LP_SZ::MiB;
 
+      /** @brief Smallest log capacity accepted */
+      static constexpr const size_t MIN_BUF_SZ = 64 * 1024;
+
+      /** @brief Bytes available for entries in log_area->content */
+      size_t capacity = BUF_SZ;
+
+      /** @brief Largest range a single log entry holds, larger log_range()
+       * requests (e.g., a loop range from the pass) are split */
+      static constexpr const size_t MAX_ENTRY_SZ = 2 * LP_SZ::MiB;
+
+      /** @brief Largest log_range() request deduplicated by cacheline, larger
+       * ones would mostly evict the filter */
+      static constexpr const size_t MAX_DEDUP_SZ = 4 * 1024;
+
 #ifdef LOG_FORMAT_VOLATILE
-      /** @brief Voltile list of all the entries */
-      std::vector<log_entry_lean_t> entries;
+      /** @brief Volatile index of the ranges logged this epoch */
+      range_set_t entries;
 #endif
 
       void clear() {
+#ifdef LOG_CHECKSUM
+        /* Invalidates every entry, the next fence makes it durable */
+        const uint64_t next_epoch = log_area->epoch + 1;
+        pmemops->streaming_wr(&log_area->epoch, &next_epoch,
+                              sizeof(log_area->epoch));
+#endif
         log_area->log_offset = 0;
         log_area->tail_ptr = RCast<uint8_t *>(log_area->content);
         last_flush_offset = 0;
-        last_log = {0};
+        logged_lines.new_epoch();
 #ifdef LOG_FORMAT_VOLATILE
         entries.clear();
 #endif
@@ -178,44 +749,221 @@ namespace nvsl {
       /** @brief Persistent log area */
       log_layout_t *log_area = nullptr;
 
-      /** @brief Get a log_layout_t object using its pid.tid name */
+      /**
+       * @brief Order in which recovery replays @p logs, the logs of one
+       * process that need recovery
+       * @details Redo logs of different threads may hold the same bytes,
+       * they are replayed by increasing commit_seq so the last commit wins,
+       * as it does with the applier. Undo logs keep their order.
+       * @return Indices into @p logs
+       */
+      static std::vector<size_t>
+      replay_order(const std::vector<const log_layout_t *> &logs) {
+        std::vector<size_t> order(logs.size());
+        std::iota(order.begin(), order.end(), 0);
+
+        const auto seq = [&](size_t i) {
+          return logs[i]->is_redo() ? logs[i]->commit_seq : 0;
+        };
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return seq(a) < seq(b); });
+        return order;
+      }
+
+      /** @brief Get a log_layout_t object using its pid.tid name, for
+       * per-thread log files from before the arena */
       static std::tuple<Log::log_layout_t *, fs::path>
       get_log_by_id(const std::string &name, void *addr = nullptr);
 
       Log();
 
+      /**
+       * @brief Return the slot to the arena when the thread exits
+       * @details Whatever the thread logged since the last snapshot is
+       * snapshotted first, snapshot() won't see the log once it's gone.
+       */
+      ~Log();
+
+      size_t get_slot() const { return slot; }
+
+      /**
+       * @brief Holds a log against the other threads using it
+       * @details The owner holds its log around appends and snapshots, other
+       * threads while they drain it (MS_SNAPSHOT_ALL, a group commit leader).
+       * Reentrant on the owner (@p owner = true), an append may snapshot the
+       * log early.
+       */
+      class guard_t {
+      public:
+        guard_t(Log &log, bool owner)
+            : log(log), owner(owner), taken(not(owner and log.owner_holds)) {
+          if (not taken) return;
+
+          log.mutex.lock();
+          if (owner) log.owner_holds = true;
+        }
+
+        ~guard_t() {
+          if (not taken) return;
+
+          if (owner) log.owner_holds = false;
+          log.mutex.unlock();
+        }
+
+        guard_t(const guard_t &) = delete;
+        guard_t &operator=(const guard_t &) = delete;
+
+      private:
+        Log &log;
+        const bool owner;
+        const bool taken;
+      };
+
+      /** @brief Check if the owner thread holds this log, only meaningful on
+       * the owner thread */
+      bool held_by_owner() const { return owner_holds; }
+
       void log_range(void *start, size_t bytes);
 
-      void set_state(State state, bool flush_whole = false) {
+      /**
+       * @brief log_range() for a size known at compile time
+       * @details Copies exactly BYTES bytes of the old value without going
+       * through real_memcpy(). Instantiated for 1, 2, 4, 8, 16, 32 and 64.
+       */
+      template <size_t BYTES>
+      void log_range(void *start);
+
+      /**
+       * @brief log_range() for an atomic store, RMW or cmpxchg of @p bytes
+       * @details The entry is durable and visible to other threads before
+       * this returns, i.e., before the atomic operation executes.
+       */
+      void log_atomic(void *start, size_t bytes);
+
+      /** @brief Set the state, tagged with the current log format */
+      void set_state(State state, bool flush_whole = false,
+                     bool drain = true) {
         NVSL_ASSERT(this->log_area != nullptr, "Log area not initialized");
 
         DBGH(3) << "Updating log state to " << state << std::endl;
 
+        const State tagged = State(state | ((uint64_t)CUR_FORMAT << 32));
+
         if (flush_whole) {
-          this->log_area->state = state;
+          this->log_area->state = tagged;
           pmemops->flush(this->log_area, sizeof(*this->log_area));
         } else {
-          pmemops->streaming_wr(&this->log_area->state, &state,
+          pmemops->streaming_wr(&this->log_area->state, &tagged,
                                 sizeof(this->log_area->state));
         }
 
-        pmemops->drain();
+        if (drain) pmemops->drain();
       }
 
       State get_state() const {
         NVSL_ASSERT(this->log_area != nullptr, "Log area not initialized");
 
-        return this->log_area->state;
+        return this->log_area->get_state();
+      }
+
+      /**
+       * @brief Make the flush_all()ed log durable before snapshot() modifies
+       * the backing file
+       * @details Checksummed entries are self-validating, so this is a single
+       * fence over the log's lines and the commit_epoch marker, recovery
+       * ignores entries logged outside a snapshot. Other formats also flip the
+       * state to ACTIVE, flushing the layout header with it. A group commit
+       * passes @p drain = false and fences once for all its logs.
+       */
+      void begin_commit(bool drain = true) {
+#ifdef LOG_CHECKSUM
+        /* Durable with the entries, end_commit() bumps the epoch past it */
+        pmemops->streaming_wr(&log_area->commit_epoch, &log_area->epoch,
+                              sizeof(log_area->commit_epoch));
+        if (drain) pmemops->drain();
+#else
+        set_state(State::ACTIVE, true, drain);
+#endif
+      }
+
+      /**
+       * @brief Drop the log once snapshot() made the backing file durable
+       * @details Checksummed logs are dropped by bumping the epoch.
+       */
+      void end_commit(bool drain = true) {
+#ifdef LOG_CHECKSUM
+        clear();
+        if (drain) pmemops->drain();
+#else
+        set_state(State::EMPTY, false, drain);
+        clear();
+#endif
       }
 
       void flush_all() const;
+
+#ifdef LOG_REDO
+      /**
+       * @brief Write the new value of every range recorded in [addr,
+       * addr+bytes) to the log and commit it
+       * @details Waits for the previous commit to be applied first. The log
+       * is durable and COMMITTED when this returns, the ranges outside
+       * [addr, addr+bytes) are dropped like the undo path drops them. The
+       * log is then queued to be applied to @p backing by the applier
+       * thread.
+       */
+      void commit_redo(void *addr, size_t bytes, uint8_t *backing);
+
+      /**
+       * @brief Seal the ranges recorded in [addr, addr+bytes) and leave the
+       * commit and the apply to @p backing to the applier thread
+       * @details The new values are copied to the log before this returns,
+       * the thread can then store to them again. Only one sealed log is in
+       * flight per thread, sealing again waits for the previous one to be
+       * applied.
+       * @return Ticket for wait_committed(), tickets of a thread increase
+       */
+      uint64_t commit_redo_async(void *addr, size_t bytes, uint8_t *backing);
+
+      /** @brief Wait until the log sealed as @p ticket is COMMITTED */
+      void wait_committed(uint64_t ticket) const;
+
+      /** @brief Check if the log sealed as @p ticket is COMMITTED */
+      bool is_committed(uint64_t ticket) const {
+        return committed_ticket.load() >= ticket;
+      }
+
+      /** @brief Wait until the applier is done with this log */
+      void wait_applied() const;
+
+      /** @brief Copy a committed redo log to @p backing and mark it EMPTY,
+       * runs on the applier thread */
+      static void apply_redo(log_layout_t *log, uint8_t *backing);
+
+      /** @brief Make a sealed log durable and mark it COMMITTED, runs on the
+       * applier thread */
+      static void persist_redo(log_layout_t *log);
+#endif
     };
 
+    /** @brief Add the calling thread's log to the registry */
     void cxlbuf_reg_tls_log();
 
+    /** @brief Remove @p log from the registry, waits for for_each_tls_log() */
+    void cxlbuf_unreg_tls_log(Log *log);
+
+    /**
+     * @brief Call @p fn on every registered thread log
+     * @details Logs can't be unregistered while this runs. The owners of the
+     * logs are not stopped, @p fn holds a log with Log::guard_t before it
+     * reads or drains it.
+     */
+    void for_each_tls_log(const std::function<void(Log &)> &fn);
+
     extern nvsl::Counter *skip_check_count, *logged_check_count,
-        *dup_log_entries, *back_to_back_dup_log, *total_log_entries,
-        *total_pers_log_entries, *mergeable_entries;
+        *dup_log_entries, *total_log_entries,
+        *total_pers_log_entries, *mergeable_entries, *unprofiled_hits,
+        *deduped_log_entries, *overflow_snapshots, *group_commits;
     extern nvsl::StatsFreq<> *tx_log_count_dist;
     extern nvsl::StatsScalar *total_bytes_wr, *total_bytes_wr_strm,
         *total_bytes_flushed;
@@ -224,4 +972,3 @@ namespace nvsl {
 
 extern thread_local nvsl::cxlbuf::Log local_log;
 extern int trace_fd;
-extern std::vector<nvsl::cxlbuf::Log *> *tls_logs;
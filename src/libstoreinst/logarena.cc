@@ -0,0 +1,183 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   logarena.cc
+ * @date   octobre 17, 2026
+ * @brief  Per-process log file carved into per-thread slots
+ */
+
+#include "logarena.hh"
+#include "libc_wrappers.hh"
+#include "libcxlfs/libcxlfs.hh"
+#include "libstoreinst.hh"
+#include "libvram/libvram.hh"
+#include "nvsl/common.hh"
+#include "nvsl/utils.hh"
+
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace nvsl;
+using layout_t = cxlbuf::Log::log_layout_t;
+
+static std::mutex arena_mutex;
+static int arena_fd = -1;
+static size_t slot_sz = 0;
+
+/** @brief Mapping of each slot, nullptr until it's first handed out */
+static std::vector<layout_t *> *slots = nullptr;
+static std::vector<size_t> *free_slots = nullptr;
+
+/** @brief Extend the arena to @p count slots */
+static void grow(size_t count) {
+  const size_t old_count = slots->size();
+
+  DBGH(1) << "Growing the log arena to " << count << " slots" << std::endl;
+
+  if (-1 == fallocate(arena_fd, 0, old_count * slot_sz,
+                      (count - old_count) * slot_sz)) {
+    perror("fallocate for log arena failed");
+    exit(1);
+  }
+
+  slots->resize(count, nullptr);
+
+  /* Hand out the lowest slots first */
+  for (size_t id = count; id > old_count; id--) free_slots->push_back(id - 1);
+}
+
+static void create() {
+  const auto fpath = cxlbuf::arena::path(getpid());
+
+  if (fs::is_regular_file(fpath)) {
+    fs::remove_all(fpath);
+  }
+
+  DBGH(1) << "Creating log arena " << fpath << std::endl;
+
+  arena_fd = open(fpath.c_str(), O_CREAT | O_RDWR, 0666);
+  if (arena_fd == -1) {
+    perror("open for log arena failed");
+    exit(1);
+  }
+
+  const size_t capacity = std::max(logCapacity, cxlbuf::Log::MIN_BUF_SZ);
+  slot_sz = (sizeof(layout_t) + capacity + 4095) & ~4095UL;
+
+  slots = new std::vector<layout_t *>;
+  free_slots = new std::vector<size_t>;
+  grow(std::max(logSlots, 1UL));
+}
+
+static layout_t *map(size_t id) {
+  layout_t *log;
+
+  if (is_prefix("/mnt/mss0/", *cxlbuf::log_loc)) {
+    log = RCast<layout_t *>(nvsl::libcxlfs::malloc(slot_sz));
+  } else if (is_prefix("/mnt/cxl0/", *cxlbuf::log_loc)) {
+    log = RCast<layout_t *>(nvsl::libvram::malloc(slot_sz));
+  } else {
+    log = RCast<layout_t *>(real_mmap(nullptr, slot_sz, PROT_READ | PROT_WRITE,
+                                      MAP_SYNC | MAP_SHARED_VALIDATE, arena_fd,
+                                      id * slot_sz));
+  }
+
+  if (log == (layout_t *)-1) {
+    perror("mmap for log slot failed");
+    exit(1);
+  }
+
+  log->slot_size = slot_sz;
+  return log;
+}
+
+cxlbuf::arena::slot_t cxlbuf::arena::acquire() {
+  std::lock_guard<std::mutex> lock(arena_mutex);
+
+  if (arena_fd == -1) [[unlikely]] {
+    create();
+  }
+
+  if (free_slots->empty()) [[unlikely]] {
+    grow(slots->size() * 2);
+  }
+
+  const size_t id = free_slots->back();
+  free_slots->pop_back();
+
+  if ((*slots)[id] == nullptr) {
+    (*slots)[id] = map(id);
+  }
+
+  return {(*slots)[id], id, slot_sz - sizeof(layout_t)};
+}
+
+void cxlbuf::arena::release(size_t id) {
+  std::lock_guard<std::mutex> lock(arena_mutex);
+
+  DBGH(1) << "Releasing log slot " << id << std::endl;
+
+  free_slots->push_back(id);
+}
+
+fs::path cxlbuf::arena::path(pid_t pid) {
+  return fs::path(*log_loc) / fs::path(S(pid) + ".arena");
+}
+
+/**
+ * @details Slots are handed out lowest first, so slot 0 is always mapped and
+ * its header has the slot size of the arena.
+ */
+size_t cxlbuf::arena::slot_count(pid_t pid) {
+  const auto fpath = path(pid);
+  if (not fs::is_regular_file(fpath)) return 0;
+
+  const int fd = open(fpath.c_str(), O_RDONLY);
+  if (fd == -1) {
+    DBGE << "Unable to open log arena " << fpath << std::endl;
+    DBGE << PSTR() << std::endl;
+    exit(1);
+  }
+
+  layout_t hdr = {};
+  const auto bytes = pread(fd, &hdr, sizeof(hdr), 0);
+  close(fd);
+
+  if (bytes != sizeof(hdr) or hdr.slot_size == 0) return 0;
+
+  return fs::file_size(fpath) / hdr.slot_size;
+}
+
+std::pair<layout_t *, size_t> cxlbuf::arena::map_slot(pid_t pid, size_t id) {
+  const auto fpath = path(pid);
+
+  const int fd = open(fpath.c_str(), O_RDWR);
+  if (fd == -1) {
+    DBGE << "Unable to open log arena " << fpath << std::endl;
+    DBGE << PSTR() << std::endl;
+    exit(1);
+  }
+
+  layout_t hdr = {};
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    DBGE << "Unable to read the header of log arena " << fpath << std::endl;
+    exit(1);
+  }
+
+  auto log = (layout_t *)real_mmap(nullptr, hdr.slot_size,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                                   id * hdr.slot_size);
+  close(fd);
+
+  if (log == (layout_t *)-1) {
+    DBGE << "Unable to mmap slot " << id << " of log arena " << fpath
+         << std::endl;
+    DBGE << PSTR() << std::endl;
+    exit(1);
+  }
+
+  return {log, hdr.slot_size};
+}
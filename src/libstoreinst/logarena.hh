@@ -0,0 +1,60 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   logarena.hh
+ * @date   octobre 17, 2026
+ * @brief  Per-process log file carved into per-thread slots
+ */
+
+#pragma once
+
+#include "log.hh"
+
+#include <cstddef>
+#include <filesystem>
+#include <sys/types.h>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace nvsl {
+  namespace cxlbuf {
+    namespace arena {
+      /** @brief Slots preallocated when the arena is created, see
+       * CXLBUF_LOG_SLOTS */
+      constexpr size_t DEFAULT_SLOTS = 16;
+
+      /** @brief A mapped slot handed to a thread's log */
+      struct slot_t {
+        Log::log_layout_t *log;
+        size_t id;
+
+        /** @brief Bytes available for entries */
+        size_t capacity;
+      };
+
+      /**
+       * @brief Take a free slot for the calling thread's log
+       * @details Creates and preallocates the arena on first use and doubles
+       * it when every slot is taken. A slot is mapped the first time it's
+       * handed out and stays mapped, so reusing one costs no syscall.
+       */
+      slot_t acquire();
+
+      /** @brief Return slot @p id, its log must be empty */
+      void release(size_t id);
+
+      /** @brief Path of the arena of process @p pid */
+      fs::path path(pid_t pid);
+
+      /** @brief Number of slots in the arena of @p pid, 0 if there is none */
+      size_t slot_count(pid_t pid);
+
+      /**
+       * @brief Map slot @p id of @p pid's arena (for recovery)
+       * @return The log and the bytes mapped, unmap with real_munmap()
+       */
+      std::pair<Log::log_layout_t *, size_t> map_slot(pid_t pid, size_t id);
+    } // namespace arena
+  }   // namespace cxlbuf
+} // namespace nvsl
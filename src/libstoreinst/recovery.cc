@@ -12,12 +12,14 @@
 #include "libstoreinst.hh"
 #include "libvram/libvram.hh"
 #include "log.hh"
+#include "logarena.hh"
 #include "nvsl/envvars.hh"
 #include "nvsl/string.hh"
 #include "nvsl/utils.hh"
 #include "recovery.hh"
 #include "utils.hh"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <filesystem>
 #include <ranges>
@@ -33,6 +35,45 @@ NVSL_DECL_ENV(CXLBUF_USE_HUGEPAGE);
 
 using namespace nvsl;
 
+/** @brief Slots of @p pid's log arena that a crash left entries in, in the
+ * order they are replayed, see Log::replay_order() */
+static std::vector<size_t> recoverable_slots(pid_t pid) {
+  std::vector<size_t> found = {};
+  std::vector<const cxlbuf::Log::log_layout_t *> logs = {};
+  std::vector<size_t> map_szs = {};
+  const size_t slots = cxlbuf::arena::slot_count(pid);
+
+  for (size_t slot = 0; slot < slots; slot++) {
+    const auto [log_ptr, map_sz] = cxlbuf::arena::map_slot(pid, slot);
+
+    if (log_ptr->needs_recovery(map_sz)) {
+      DBGH(2) << "Log slot " << slot << " needs recovery" << std::endl;
+      found.push_back(slot);
+      logs.push_back(log_ptr);
+      map_szs.push_back(map_sz);
+    } else if (-1 == real_munmap(log_ptr, map_sz)) {
+      DBGE << "munmap for log slot failed" << std::endl;
+      DBGE << PSTR();
+      exit(1);
+    }
+  }
+
+  std::vector<size_t> result = {};
+  for (const auto i : cxlbuf::Log::replay_order(logs)) {
+    result.push_back(found[i]);
+  }
+
+  for (size_t i = 0; i < logs.size(); i++) {
+    if (-1 == real_munmap((void *)logs[i], map_szs[i])) {
+      DBGE << "munmap for log slot failed" << std::endl;
+      DBGE << PSTR();
+      exit(1);
+    }
+  }
+
+  return result;
+}
+
 std::vector<std::string> cxlbuf::PmemFile::needs_recovery() const {
   std::vector<std::string> result = {};
   const auto dfname = this->get_dependency_fname();
@@ -50,6 +91,20 @@ std::vector<std::string> cxlbuf::PmemFile::needs_recovery() const {
       DBGH(3) << "Checking log " << log << std::endl;
 
       const auto toks = split(log, ",", 3);
+      const auto pid = std::stoi(toks[0]);
+
+      /* Any thread of the process may have logged stores to the file, so
+         every slot of its arena is checked */
+      if (arena::slot_count(pid) != 0) {
+        for (const auto slot : recoverable_slots(pid)) {
+          result.push_back(toks[0] + "," + S(slot) + "," + toks[2]);
+        }
+
+        if (not result.empty()) break;
+        continue;
+      }
+
+      /* Per-thread log file from before the arena, named after the tid */
       const auto lfname = *log_loc + "/" + toks[0] + "." + toks[1] + ".log";
 
       if (fs::is_regular_file(lfname)) {
@@ -57,14 +112,14 @@ std::vector<std::string> cxlbuf::PmemFile::needs_recovery() const {
 
         const auto [log_ptr, _] = Log::get_log_by_id(toks[0] + "." + toks[1]);
 
-        if (log_ptr->state == Log::State::ACTIVE) {
+        if (log_ptr->needs_recovery(fs::file_size(lfname))) {
           DBGH(2) << "Log needs recovery" << std::endl;
 
           result.push_back(log);
           break;
         } else {
           DBGH(2) << "Log does not need recovery. Log state = "
-                  << (int)log_ptr->state << std::endl;
+                  << (int)log_ptr->get_state() << std::endl;
         }
 
         int mu_ret = real_munmap(log_ptr, fs::file_size(lfname));
@@ -91,16 +146,26 @@ void cxlbuf::PmemFile::recover(const std::vector<std::string> &logs) {
   for (const auto &log : logs) {
     const auto toks = split(log, ",", 3);
     const auto pid = std::stoi(toks[0]);
-    const auto tid = std::stoull(toks[1]);
+    const auto id = std::stoull(toks[1]);
     auto addr = (void *)std::stoull(toks[2]);
 
-    DBGH(4) << "Log pid = " << pid << " tid = " << tid
+    DBGH(4) << "Log pid = " << pid << " slot (or tid) = " << id
             << " addr = " << (void *)addr << std::endl;
 
-    const auto [log_ptr, lfname] = Log::get_log_by_id(S(pid) + "." + S(tid));
+    Log::log_layout_t *log_ptr;
+    size_t map_sz;
 
-    DBGH(4) << "Total log size " << log_ptr->log_offset << " bytes"
-            << std::endl;
+    if (arena::slot_count(pid) != 0) {
+      std::tie(log_ptr, map_sz) = arena::map_slot(pid, id);
+    } else {
+      const auto [legacy_ptr, lfname] =
+          Log::get_log_by_id(S(pid) + "." + S(id));
+      log_ptr = legacy_ptr;
+      map_sz = fs::file_size(lfname);
+    }
+
+    DBGH(4) << "Total log size " << log_ptr->log_offset << " bytes, format "
+            << log_ptr->format() << std::endl;
 
     DBGH(1) << "Replaying log" << std::endl;
 
@@ -126,54 +191,54 @@ void cxlbuf::PmemFile::recover(const std::vector<std::string> &logs) {
     }
 
     // Find log entries that apply to this file
-    using log_entry_t = Log::log_entry_t;
-    size_t cur_off = 0;
-    std::vector<size_t> log_entries;
+    std::vector<Log::entry_view_t> log_entries;
 
     /* Undo log is applied last entry first, so we need to find all the log
-       entires first */
-    while (cur_off < log_ptr->log_offset) {
-      log_entry_t *entry =
-          (log_entry_t *)&(((char *)log_ptr->content)[cur_off]);
-
-      DBGH(4) << "Checking entry (" << entry->addr << ", " << entry->bytes
+       entires first. The iterator decodes all the formats, checksummed logs
+       are only replayed up to their first invalid entry. A redo log
+       (LOG_REDO) only needs recovery once committed and is applied in
+       order. */
+    const auto entries_end = log_ptr->replay_end(map_sz);
+    for (auto it = log_ptr->begin(); it != entries_end; ++it) {
+      const auto &entry = *it;
+
+      DBGH(4) << "Checking entry (" << entry.addr << ", " << entry.bytes
               << ")" << std::endl;
 
-      if (((size_t)addr <= entry->addr) and
-          (entry->addr <
-           ((size_t)addr + this->len)) /*and entry->is_disabled != 1*/) {
-        const auto dst_addr = (void *)(size_t)entry->addr;
+      if (((size_t)addr <= entry.addr) and
+          (entry.addr < ((size_t)addr + this->len))) {
+        const auto dst_addr = (void *)(size_t)entry.addr;
 
         DBGH(4) << "Recovering location " << dst_addr << "...";
 
-        log_entries.push_back(cur_off);
+        log_entries.push_back(entry);
 
         DBG << "done" << std::endl;
       } else {
         DBGH(4) << "No recovery needed" << std::endl;
       }
-
-      cur_off += entry->bytes + sizeof(log_entry_t);
-
-      DBGH(4) << "New offset = " << cur_off << std::endl;
     }
 
-    /* Apply the undo logs in the reverse order */
-    for (const auto &entry_off : log_entries | std::views::reverse) {
-      const log_entry_t *entry =
-          (log_entry_t *)&(((char *)log_ptr->content)[entry_off]);
-      const auto dst_addr = (void *)(size_t)entry->addr;
+    const auto apply = [](const Log::entry_view_t &entry) {
+      const auto dst_addr = (void *)(size_t)entry.addr;
 
       // Write, flush and drain
-      real_memcpy(dst_addr, entry->content, entry->bytes);
-      pmemops->flush(dst_addr, entry->bytes);
+      real_memcpy(dst_addr, entry.content, entry.bytes);
+      pmemops->flush(dst_addr, entry.bytes);
       pmemops->drain();
+    };
+
+    if (log_ptr->is_redo()) {
+      std::ranges::for_each(log_entries, apply);
+    } else {
+      /* Apply the undo logs in the reverse order */
+      std::ranges::for_each(log_entries | std::views::reverse, apply);
     }
 
     // Release all resources
     close(fd);
 
-    int mu_ret = real_munmap(log_ptr, fs::file_size(lfname));
+    int mu_ret = real_munmap(log_ptr, map_sz);
 
     if (mu_ret == -1) {
       DBGE << "munmap for log failed" << std::endl;
@@ -399,11 +464,13 @@ void cxlbuf::PmemFile::write_dependency_internal() {
     exit(1);
   }
 
+  /* Recovery checks every slot of the process's log arena, the slot of the
+     mapping thread is recorded for reference */
   const int pid = getpid();
-  const pthread_t tid = pthread_self();
+  const size_t slot = local_log.get_slot();
 
   const auto entry =
-      S(pid) + "," + S(tid) + "," + S((uint64_t)this->addr) + "\n";
+      S(pid) + "," + S(slot) + "," + S((uint64_t)this->addr) + "\n";
 
   const auto bytes = write(fd, entry.c_str(), strlen(entry.c_str()));
 
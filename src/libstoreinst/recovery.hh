@@ -50,11 +50,11 @@ namespace nvsl {
       std::pair<void *, size_t> get_map_dimensions() const;
 
       /**
-       * @brief Add pid.tid entry to the dependency file
+       * @brief Add pid,slot,addr entry to the dependency file
        *
        * @details Add an entry for this process to the dependency file. This
-       * will allow us to locate the logs when the file is openede after a
-       * crash.
+       * will allow us to locate the log arena when the file is openede after
+       * a crash.
        */
       void write_dependency();
 
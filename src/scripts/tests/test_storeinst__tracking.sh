@@ -0,0 +1,40 @@
+#!/usr/bin/env sh
+
+if [ -z "$CXLBUF_RUNNING_TESTS" ]; then
+    echo "Do not run individual test files directly. Use run.sh" 1>&2
+    exit 1
+fi
+
+# Stores before and after startTracking is set must each be logged, the first
+# one ran untracked and logged nothing
+test_storeinst_tracking_barrier() {
+    ir=$(mktemp --suffix=.ll)
+    cat > "$ir" <<'IR'
+@startTracking = external global i8
+
+define void @redundant(i64* %p) {
+  store i64 1, i64* %p
+  store i8 1, i8* @startTracking
+  store i64 2, i64* %p
+  ret void
+}
+
+define void @adjacent(i64* %p) {
+  %q = getelementptr i64, i64* %p, i64 1
+  store i64 1, i64* %p
+  %old = atomicrmw xchg i8* @startTracking, i8 1 seq_cst
+  store i64 2, i64* %q
+  ret void
+}
+IR
+
+    printf "> Instrumenting\n"
+    logged=$("$LLVM_DIR/bin/opt" \
+                 -load-pass-plugin "$DCLANG_LIBS_DIR/libstoreinstpass.so" \
+                 -passes=storeinst "$ir" -S -o - 2>/dev/null \
+                 | grep -c 'call void @logMemory_8')
+    rm -f "$ir"
+
+    assertEquals 4 "${logged}"
+}
+# suite_addTest test_storeinst_tracking_barrier
@@ -13,26 +13,50 @@
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include <cstdarg>
 #include <cxxabi.h>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/CFG.h>
 #include <llvm/Analysis/CGSCCPassManager.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
 #include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/MemoryBuiltins.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <llvm/Pass.h>
 #include <sstream>
@@ -45,9 +69,14 @@ using namespace llvm;
 namespace {
 
 size_t modCount = 0, skipCount = 0, skipFn = 0, aliasedLocationFound = 0,
-       exactLocationMatchFound = 0;
+       exactLocationMatchFound = 0, loopCoalescedCount = 0, redundantCount = 0,
+       mergedCount = 0, nonPmemCount = 0, unprofiledCount = 0, clonedCount = 0,
+       memIntrinsicCount = 0, atomicCount = 0, knownPmemCount = 0,
+       unmarkedCount = 0, vectorCount = 0;
 
 const char *DontAutoLogStr = "CXLBUF_DONT_AUTO_LOG";
+/** @brief Identity function CXLBUF_PMEM() wraps pointers known to be PMEM in */
+const char *PmemMarkerStr = "cxlbuf_pmem";
 
 static void log(char *msg, ...) {
   va_list(arg);
@@ -59,12 +88,144 @@ static void log(char *msg, ...) {
   va_end(arg);
 }
 
-static FunctionCallee createRuntimeCheckFunc(Module &m) {
-  Type *VoidType = Type::getVoidTy(m.getContext());
-  Type *VoidPtrType = Type::getInt8PtrTy(m.getContext());
-  FunctionType *FuncType =
+/** @brief Store widths with a fixed-size logMemory_<N> entry point */
+const uint64_t FixedLogSizes[] = {1, 2, 4, 8, 16, 32, 64};
+
+/** @brief Runtime symbols referenced by the inlined range check */
+struct RuntimeSyms {
+  /** @brief logMemory_<N>(i8*) keyed by the store size N */
+  std::map<uint64_t, FunctionCallee> logMemoryFixed;
+  /** @brief logMemory_n(i8*, i64) for all the other sizes */
+  FunctionCallee logMemoryN;
+  /** @brief logMemoryUnprofiled(i8*, i64) for sites never seen in a census */
+  FunctionCallee logMemoryUnprofiled;
+  /** @brief logMemoryAtomic(i8*, i64) for atomic stores, RMWs and cmpxchgs */
+  FunctionCallee logMemoryAtomic;
+  /** @brief logMemoryScatter(i8**, i64 lanes, i64 n, i64 size) for scatters */
+  FunctionCallee logMemoryScatter;
+  /** @brief censusHit(i64) records a site hitting the range in a census run */
+  FunctionCallee censusHit;
+  /** @brief siteHit(i64, i64) counts the hits and logged bytes of a site */
+  FunctionCallee siteHit;
+  Constant *startTracking;
+  Constant *startAddr;
+  Constant *endAddr;
+};
+
+static RuntimeSyms createRuntimeSyms(Module &m) {
+  LLVMContext &c = m.getContext();
+  Type *VoidType = Type::getVoidTy(c);
+  Type *VoidPtrType = Type::getInt8PtrTy(c);
+  Type *SizeType = Type::getInt64Ty(c);
+  FunctionType *FixedFuncType =
       FunctionType::get(VoidType, ArrayRef<Type *>(VoidPtrType), false);
-  return m.getOrInsertFunction("checkMemory", FuncType);
+  FunctionType *SizedFuncType =
+      FunctionType::get(VoidType, {VoidPtrType, SizeType}, false);
+
+  /* Only called once the inlined check hits the tracked range */
+  AttributeList attrs = AttributeList().addFnAttribute(c, Attribute::Cold);
+
+  RuntimeSyms result;
+  for (const uint64_t size : FixedLogSizes) {
+    result.logMemoryFixed[size] = m.getOrInsertFunction(
+        "logMemory_" + std::to_string(size), FixedFuncType, attrs);
+  }
+  result.logMemoryN =
+      m.getOrInsertFunction("logMemory_n", SizedFuncType, attrs);
+  result.logMemoryUnprofiled =
+      m.getOrInsertFunction("logMemoryUnprofiled", SizedFuncType, attrs);
+  result.logMemoryAtomic =
+      m.getOrInsertFunction("logMemoryAtomic", SizedFuncType, attrs);
+  result.logMemoryScatter = m.getOrInsertFunction(
+      "logMemoryScatter",
+      FunctionType::get(VoidType,
+                        {VoidPtrType->getPointerTo(), SizeType, SizeType,
+                         SizeType},
+                        false),
+      attrs);
+  result.censusHit = m.getOrInsertFunction(
+      "censusHit", FunctionType::get(VoidType, {SizeType}, false), attrs);
+  result.siteHit = m.getOrInsertFunction(
+      "siteHit", FunctionType::get(VoidType, {SizeType, SizeType}, false),
+      attrs);
+  result.startTracking =
+      m.getOrInsertGlobal("startTracking", Type::getInt8Ty(c));
+  result.startAddr = m.getOrInsertGlobal("start_addr", VoidPtrType);
+  result.endAddr = m.getOrInsertGlobal("end_addr", VoidPtrType);
+
+  return result;
+}
+
+/**
+ * @brief Store-site profile for the two-phase build
+ *
+ * @details With DCLANG_CENSUS set, every instrumented site reports its stable
+ * ID to the runtime the first time it hits the tracked range, and the runtime
+ * writes the IDs to CXLBUF_CENSUS_FILE on exit. Rebuilding with
+ * DCLANG_PROFILE=<census file> keeps the full check for the sites in the file
+ * and only leaves a cheap range guard on the others. DCLANG_SITE_COUNTERS
+ * makes every hit report the site ID and the bytes logged, the runtime writes
+ * the totals to CXLBUF_SITE_HITS_FILE.
+ */
+struct SiteProfile {
+  bool census = false;
+  bool counters = false;
+  bool loaded = false;
+  std::unordered_set<uint64_t> hot;
+
+  bool neverSeen(uint64_t id) const { return loaded and hot.count(id) == 0; }
+
+  static SiteProfile fromEnv() {
+    SiteProfile result;
+    result.census = getenv("DCLANG_CENSUS") != nullptr;
+    result.counters = getenv("DCLANG_SITE_COUNTERS") != nullptr;
+
+    const char *fname = getenv("DCLANG_PROFILE");
+    if (fname == nullptr) return result;
+
+    std::ifstream profile(fname);
+    if (not profile.is_open()) {
+      errs() << COLOR "Unable to open store-site profile " << fname
+             << END "\n";
+      exit(1);
+    }
+
+    std::string line;
+    while (std::getline(profile, line)) {
+      if (not line.empty()) result.hot.insert(std::stoull(line, nullptr, 16));
+    }
+
+    result.loaded = true;
+    return result;
+  }
+};
+
+/**
+ * @brief Stable ID of a store site, the same across rebuilds of the same source
+ * @param[in] ordinal Index of the store among all the stores of @p f
+ * @details With DCLANG_LTO the file and name come from the function's debug
+ * info (dclang adds line tables): the LTO module is named after the linker's
+ * temporary object and may rename internal functions. Stores inlined across
+ * TUs at link time shift the ordinals, so LTO and non-LTO builds don't share
+ * IDs.
+ */
+static uint64_t getSiteId(const Function &f, size_t ordinal) {
+  static const bool lto = getenv("DCLANG_LTO") != nullptr;
+
+  std::string file = f.getParent()->getSourceFileName();
+  std::string name = f.getName().str();
+
+  if (const DISubprogram *sp = lto ? f.getSubprogram() : nullptr) {
+    file = (sp->getDirectory() + "/" + sp->getFilename()).str();
+    if (not sp->getLinkageName().empty()) {
+      name = sp->getLinkageName().str();
+    } else if (not sp->getName().empty()) {
+      name = sp->getName().str();
+    }
+  }
+
+  const std::string key = file + ":" + name + ":" + std::to_string(ordinal);
+  return xxHash64(key);
 }
 
 std::string demangleSym(const std::string &mangledName) {
@@ -75,6 +236,69 @@ std::string demangleSym(const std::string &mangledName) {
   return (status == 0) ? demangledName : mangledName;
 }
 
+/**
+ * @brief Per-site instrumentation report, enabled with DCLANG_REPORT=<file>
+ *
+ * @details Appends one JSON object per line for every store site: its ID (the
+ * one the census and the runtime's per-site counters use), function, source
+ * location, kind, size and what the pass did with it.
+ */
+class SiteReport {
+  std::string fname;
+  std::vector<json::Value> records;
+
+public:
+  SiteReport() {
+    if (const char *env = getenv("DCLANG_REPORT")) fname = env;
+  }
+
+  bool enabled() const { return not fname.empty(); }
+
+  /** @param[in] size Bytes written, 0 if unknown at compile time */
+  void add(const Instruction *i, uint64_t id, StringRef kind, uint64_t size,
+           StringRef action) {
+    if (not enabled()) return;
+
+    /* Plain C names like "f" would demangle as types */
+    const StringRef func = i->getFunction()->getName();
+    json::Object record{
+        {"id", utohexstr(id, true)},
+        {"function", func.startswith("_Z") ? demangleSym(func.str())
+                                           : func.str()},
+        {"kind", kind},
+        {"action", action},
+    };
+
+    if (const DILocation *loc = i->getDebugLoc().get()) {
+      record["file"] = loc->getFilename();
+      record["line"] = loc->getLine();
+      record["column"] = loc->getColumn();
+    } else {
+      record["file"] = i->getModule()->getSourceFileName();
+    }
+
+    if (size != 0) record["size"] = size;
+
+    records.emplace_back(std::move(record));
+  }
+
+  void write() const {
+    if (not enabled() or records.empty()) return;
+
+    std::error_code ec;
+    raw_fd_ostream out(fname, ec, sys::fs::OF_Append);
+    if (ec) {
+      errs() << COLOR "Unable to open site report " << fname << ": "
+             << ec.message() << END "\n";
+      exit(1);
+    }
+
+    for (const json::Value &record : records) {
+      out << record << "\n";
+    }
+  }
+};
+
 /** @brief Check if the store instruction aliases to any of the stack ptrs */
 bool writesToStackLocation(AAResults &aa, const StoreInst *si,
                            std::unordered_map<Value *, bool> &stackValues) {
@@ -128,31 +352,1326 @@ std::set<Function *> getAnnotatedFunctions(Module *M) {
   return result;
 }
 
-void analyseFunc(AAResults &aa, Function &f, FunctionCallee &checkMemory) {
+/**
+ * @brief Module-level analysis of pointers that can never point to PMEM
+ *
+ * @details PMEM is only reachable through the files mapped in
+ * [start_addr, end_addr), so a pointer whose underlying objects are all stack
+ * slots, globals (including thread-locals) or heap allocations from the C/C++
+ * allocation functions never needs a range check. Arguments and return values
+ * of functions with local linkage are tracked interprocedurally: they are
+ * non-PMEM if every call site passes (or every return returns) a non-PMEM
+ * pointer. Starts optimistic and drops candidates until a fixpoint.
+ */
+class NonPmemInfo {
+public:
+  using GetTLI = std::function<const TargetLibraryInfo &(Function &)>;
+
+private:
+  GetTLI getTLI;
+  SmallPtrSet<const Argument *, 32> nonPmemArgs;
+  SmallPtrSet<const Function *, 32> nonPmemRets;
+
+  /** @brief Check if all uses of @p f are direct calls in this module */
+  static bool allCallersKnown(const Function &f) {
+    if (not f.hasLocalLinkage() or f.isDeclaration()) return false;
+
+    for (const Use &u : f.uses()) {
+      const auto *cb = dyn_cast<CallBase>(u.getUser());
+      if (not cb or not cb->isCallee(&u)) return false;
+    }
+
+    return true;
+  }
+
+  bool isNonPmemObject(const Value *obj) const {
+    if (isa<AllocaInst>(obj) or isa<GlobalVariable>(obj) or
+        isa<ConstantPointerNull>(obj)) {
+      return true;
+    }
+
+    if (const auto *arg = dyn_cast<Argument>(obj)) {
+      return nonPmemArgs.count(arg) != 0;
+    }
+
+    if (const auto *cb = dyn_cast<CallBase>(obj)) {
+      Function *caller = const_cast<Function *>(cb->getFunction());
+      const Function *callee = cb->getCalledFunction();
+
+      return isAllocationFn(cb, &getTLI(*caller)) or
+             (callee and nonPmemRets.count(callee) != 0);
+    }
+
+    return false;
+  }
+
+public:
+  NonPmemInfo(Module &m, GetTLI getTLI) : getTLI(getTLI) {
+    std::vector<Function *> candidates;
+
+    for (Function &f : m) {
+      if (not allCallersKnown(f)) continue;
+
+      candidates.push_back(&f);
+      for (const Argument &arg : f.args()) {
+        if (arg.getType()->isPointerTy()) nonPmemArgs.insert(&arg);
+      }
+      if (f.getReturnType()->isPointerTy()) nonPmemRets.insert(&f);
+    }
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+
+      for (Function *f : candidates) {
+        for (const Argument &arg : f->args()) {
+          if (not nonPmemArgs.count(&arg)) continue;
+
+          for (const User *u : f->users()) {
+            const auto *cb = cast<CallBase>(u);
+            if (not isNonPmem(cb->getArgOperand(arg.getArgNo()))) {
+              nonPmemArgs.erase(&arg);
+              changed = true;
+              break;
+            }
+          }
+        }
+
+        if (not nonPmemRets.count(f)) continue;
+
+        for (const BasicBlock &bb : *f) {
+          const auto *ret = dyn_cast<ReturnInst>(bb.getTerminator());
+          if (ret and not isNonPmem(ret->getReturnValue())) {
+            nonPmemRets.erase(f);
+            changed = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  /** @brief Check if @p ptr can never point to PMEM */
+  bool isNonPmem(const Value *ptr) const {
+    SmallVector<const Value *, 4> objs;
+    getUnderlyingObjects(ptr, objs);
+
+    return all_of(objs, [&](const Value *obj) { return isNonPmemObject(obj); });
+  }
+};
+
+/**
+ * @brief Module-level analysis of pointers known to point to PMEM
+ *
+ * @details Pointers returned by cxlbuf_pmem() (the CXLBUF_PMEM() macro in
+ * libstoreinst.hh) and pointers derived from them always point to PMEM, so
+ * their stores only need the tracking check. Functions whose every return is
+ * such a pointer (e.g., reservoir_t::malloc<T>()) pass the mark on to their
+ * callers. With DCLANG_PMEM_STRICT set, only these pointers are instrumented.
+ */
+class PmemInfo {
+  const Function *marker;
+  SmallPtrSet<const Function *, 32> pmemRets;
+
+  bool isPmemObject(const Value *obj) const {
+    const auto *cb = dyn_cast<CallBase>(obj);
+    if (not cb) return false;
+
+    const Function *callee = cb->getCalledFunction();
+    return callee and (callee == marker or pmemRets.count(callee) != 0);
+  }
+
+public:
+  /** @brief Skip all the stores to pointers not known to be PMEM */
+  const bool strict;
+
+  explicit PmemInfo(Module &m)
+      : marker(m.getFunction(PmemMarkerStr)),
+        strict(getenv("DCLANG_PMEM_STRICT") != nullptr) {
+    if (not marker) return;
+
+    /* Grows from empty, recursive functions only get marked if some other
+       return path marks them */
+    bool changed = true;
+    while (changed) {
+      changed = false;
+
+      for (const Function &f : m) {
+        if (f.isDeclaration() or f.isInterposable() or
+            not f.getReturnType()->isPointerTy() or pmemRets.count(&f)) {
+          continue;
+        }
+
+        const bool allPmem = all_of(f, [&](const BasicBlock &bb) {
+          const auto *ret = dyn_cast<ReturnInst>(bb.getTerminator());
+          return not ret or isPmem(ret->getReturnValue());
+        });
+
+        if (allPmem) {
+          pmemRets.insert(&f);
+          changed = true;
+        }
+      }
+    }
+  }
+
+  /** @brief Check if @p ptr always points to PMEM */
+  bool isPmem(const Value *ptr) const {
+    if (not marker) return false;
+
+    SmallVector<const Value *, 4> objs;
+    getUnderlyingObjects(ptr, objs);
+
+    return all_of(objs, [&](const Value *obj) { return isPmemObject(obj); });
+  }
+
+  /** @brief Replace the calls to cxlbuf_pmem() with their argument */
+  static void removeMarkers(Module &m) {
+    Function *marker = m.getFunction(PmemMarkerStr);
+    if (not marker) return;
+
+    for (User *u : make_early_inc_range(marker->users())) {
+      auto *cb = dyn_cast<CallBase>(u);
+      if (cb and cb->getCalledFunction() == marker) {
+        cb->replaceAllUsesWith(cb->getArgOperand(0));
+        cb->eraseFromParent();
+      }
+    }
+
+    if (marker->use_empty() and
+        (marker->isDeclaration() or marker->isDiscardableIfUnused())) {
+      marker->eraseFromParent();
+    }
+  }
+};
+
+/** @brief Per-function analyses used while instrumenting */
+struct FuncAnalyses {
+  AAResults &aa;
+  DominatorTree &dt;
+  LoopInfo &li;
+  ScalarEvolution &se;
+};
+
+/**
+ * @brief A store in a loop whose writes cover a range computable in the
+ * preheader
+ */
+struct LoopRange {
+  StoreInst *si;
+  /** @brief Stable site ID, see getSiteId() */
+  uint64_t id;
+  Loop *loop;
+  const SCEVAddRecExpr *ptr;
+  /** @brief Number of times @p si executes, i64 */
+  const SCEV *count;
+  int64_t step;
+  uint64_t size;
+};
+
+static uint64_t getStoreSize(const StoreInst *si) {
+  const DataLayout &dl = si->getModule()->getDataLayout();
+  return dl.getTypeStoreSize(si->getValueOperand()->getType()).getFixedSize();
+}
+
+/**
+ * @brief Emit the tracking/range check for @p ptr in front of @p before
+ *
+ * @details Emits the equivalent of the runtime's checkMemory() inline. Only the
+ * branch that hits [start_addr, end_addr) (and @p extraCond, if set) calls into
+ * the runtime, everything else falls through without a call. With @p len, the
+ * branch is taken if any byte of [ptr, ptr + len) is in the range.
+ *
+ * @return Terminator of the cold block to insert the logging call before
+ */
+Instruction *emitRangeCheck(Instruction *before, Value *ptr, RuntimeSyms &rt,
+                            Value *extraCond = nullptr,
+                            Value *len = nullptr) {
+  LLVMContext &c = before->getContext();
+  Type *VoidPtrType = Type::getInt8PtrTy(c);
+  IRBuilder<> irb(before);
+
+  Value *tracking =
+      irb.CreateLoad(irb.getInt8Ty(), rt.startTracking, "sip.tracking");
+  Value *startAddr = irb.CreateLoad(VoidPtrType, rt.startAddr, "sip.start");
+  Value *endAddr = irb.CreateLoad(VoidPtrType, rt.endAddr, "sip.end");
+
+  Value *isTracking = irb.CreateICmpNE(tracking, irb.getInt8(0));
+  Value *aboveStart =
+      len ? irb.CreateICmpULT(startAddr,
+                              irb.CreateGEP(irb.getInt8Ty(), ptr, len))
+          : irb.CreateICmpULE(startAddr, ptr);
+  Value *belowEnd = irb.CreateICmpULT(ptr, endAddr);
+  Value *hit =
+      irb.CreateAnd(isTracking, irb.CreateAnd(aboveStart, belowEnd), "sip.hit");
+
+  if (extraCond) {
+    hit = irb.CreateAnd(hit, extraCond, "sip.hit");
+  }
+
+  /* Almost all the instrumented stores miss the tracked range */
+  MDNode *weights = MDBuilder(c).createBranchWeights(1, 1 << 20);
+  return SplitBlockAndInsertIfThen(hit, before, false, weights);
+}
+
+/**
+ * @brief Emit only the startTracking part of the check in front of @p before
+ * @details For pointers known to be PMEM, see PmemInfo
+ * @return Terminator of the cold block to insert the logging call before
+ */
+Instruction *emitTrackingCheck(Instruction *before, RuntimeSyms &rt) {
+  IRBuilder<> irb(before);
+
+  Value *tracking =
+      irb.CreateLoad(irb.getInt8Ty(), rt.startTracking, "sip.tracking");
+  Value *hit = irb.CreateICmpNE(tracking, irb.getInt8(0), "sip.hit");
+
+  knownPmemCount++;
+  return SplitBlockAndInsertIfThen(hit, before, false);
+}
+
+/**
+ * @brief Log the part of [base, base + len) inside [start_addr, end_addr) in
+ * front of @p before, for ranges that can straddle either end
+ * @return Bytes logged, i64
+ */
+Value *emitClampedLog(Instruction *before, Value *base, Value *len,
+                      RuntimeSyms &rt) {
+  IRBuilder<> irb(before);
+  Type *i64 = irb.getInt64Ty();
+  Type *i8Ptr = Type::getInt8PtrTy(before->getContext());
+
+  Value *startAddr = irb.CreateLoad(i8Ptr, rt.startAddr, "sip.start");
+  Value *endAddr = irb.CreateLoad(i8Ptr, rt.endAddr, "sip.end");
+  Value *rangeEnd = irb.CreateGEP(irb.getInt8Ty(), base, len);
+
+  Value *lo = irb.CreateBinaryIntrinsic(Intrinsic::umax,
+                                        irb.CreatePtrToInt(base, i64),
+                                        irb.CreatePtrToInt(startAddr, i64));
+  Value *hi = irb.CreateBinaryIntrinsic(Intrinsic::umin,
+                                        irb.CreatePtrToInt(rangeEnd, i64),
+                                        irb.CreatePtrToInt(endAddr, i64));
+  Value *clampedLen = irb.CreateSub(hi, lo, "sip.len");
+
+  irb.CreateCall(rt.logMemoryN, {irb.CreateIntToPtr(lo, i8Ptr), clampedLen});
+  return clampedLen;
+}
+
+/**
+ * @brief A log call planned in front of a store, covering
+ * [base + offset, base + offset + size)
+ */
+struct LogSite {
+  StoreInst *si;
+  /** @brief Stable site ID, see getSiteId() */
+  uint64_t id;
+  Value *base;
+  int64_t offset;
+  uint64_t size;
+  /** @brief Range was widened to cover a neighbouring store */
+  bool widened;
+  /** @brief Covered by another site, no instrumentation needed */
+  bool eliminated;
+  /** @brief Known to point to PMEM, no range check needed */
+  bool pmem;
+
+  bool covers(const LogSite &other) const {
+    return base == other.base and offset <= other.offset and
+           other.offset + (int64_t)other.size <= offset + (int64_t)size;
+  }
+};
+
+/** @brief Largest range adjacent stores are merged into */
+constexpr uint64_t MaxMergedLogSize = 64;
+
+static LogSite makeLogSite(StoreInst *si, uint64_t id, bool pmem) {
+  const DataLayout &dl = si->getModule()->getDataLayout();
+  int64_t offset = 0;
+  Value *base =
+      GetPointerBaseWithConstantOffset(si->getPointerOperand(), offset, dl);
+
+  return {si, id, base, offset, getStoreSize(si), false, false, pmem};
+}
+
+/**
+ * @brief Emit only the range part of the check, (ptr - start) < (end - start)
+ * @details Cheap guard for sites a census never saw hitting the range, the
+ * runtime checks startTracking once the guard hits.
+ * @return Terminator of the cold block to insert the logging call before
+ */
+Instruction *emitRangeGuard(Instruction *before, Value *ptr, RuntimeSyms &rt) {
+  LLVMContext &c = before->getContext();
+  Type *VoidPtrType = Type::getInt8PtrTy(c);
+  IRBuilder<> irb(before);
+
+  Value *startAddr = irb.CreatePtrToInt(
+      irb.CreateLoad(VoidPtrType, rt.startAddr, "sip.start"), irb.getInt64Ty());
+  Value *endAddr = irb.CreatePtrToInt(
+      irb.CreateLoad(VoidPtrType, rt.endAddr, "sip.end"), irb.getInt64Ty());
+  Value *off = irb.CreateSub(irb.CreatePtrToInt(ptr, irb.getInt64Ty()),
+                             startAddr);
+  Value *hit = irb.CreateICmpULT(off, irb.CreateSub(endAddr, startAddr),
+                                 "sip.hit");
+
+  MDNode *weights = MDBuilder(c).createBranchWeights(1, 1 << 20);
+  return SplitBlockAndInsertIfThen(hit, before, false, weights);
+}
+
+/**
+ * @brief Report the site to the runtime the first time it hits in a census run
+ */
+void emitCensusHit(Instruction *before, uint64_t id, RuntimeSyms &rt) {
+  Module &m = *before->getModule();
+  IRBuilder<> irb(before);
+
+  auto *seen = new GlobalVariable(m, irb.getInt8Ty(), false,
+                                  GlobalValue::PrivateLinkage,
+                                  irb.getInt8(0), "sip.census");
+  Value *first =
+      irb.CreateICmpEQ(irb.CreateLoad(irb.getInt8Ty(), seen), irb.getInt8(0));
+
+  IRBuilder<> thenIrb(SplitBlockAndInsertIfThen(first, before, false));
+  thenIrb.CreateStore(thenIrb.getInt8(1), seen);
+  thenIrb.CreateCall(rt.censusHit, ArrayRef<Value *>(thenIrb.getInt64(id)));
+}
+
+/**
+ * @brief Emit the census and per-site counter calls enabled in @p profile
+ * @param[in] thenTerm Terminator of the block that logs the site
+ * @param[in] bytes i64 bytes the site logs
+ */
+void emitSiteHooks(Instruction *thenTerm, uint64_t id, Value *bytes,
+                   RuntimeSyms &rt, const SiteProfile &profile) {
+  if (profile.counters) {
+    IRBuilder<> irb(thenTerm);
+    irb.CreateCall(rt.siteHit, {irb.getInt64(id), bytes});
+  }
+
+  if (profile.census) {
+    emitCensusHit(thenTerm, id, rt);
+  }
+}
+
+/**
+ * @brief Instrument a store with an inline range check
+ *
+ * @details The runtime is passed the store size from the DataLayout, so it logs
+ * exactly the bytes the store overwrites. Widened sites log their whole range
+ * instead.
+ */
+const char *instrumentStore(const LogSite &site, RuntimeSyms &rt,
+                            const SiteProfile &profile) {
+  StoreInst *si = site.si;
+  Type *VoidPtrType = Type::getInt8PtrTy(si->getContext());
+  IRBuilder<> irb(si);
+
+  Value *ptr = nullptr;
+  if (site.widened) {
+    ptr = irb.CreateGEP(irb.getInt8Ty(),
+                        irb.CreatePointerCast(site.base, VoidPtrType),
+                        irb.getInt64(site.offset), "sip.merged");
+  } else {
+    ptr = irb.CreatePointerCast(si->getPointerOperand(), VoidPtrType,
+                                si->getPointerOperand()->getName());
+  }
+
+  if (not site.pmem and profile.neverSeen(site.id)) {
+    Instruction *thenTerm = emitRangeGuard(si, ptr, rt);
+    IRBuilder<> thenIrb(thenTerm);
+    thenIrb.CreateCall(rt.logMemoryUnprofiled,
+                       {ptr, thenIrb.getInt64(site.size)});
+    emitSiteHooks(thenTerm, site.id, thenIrb.getInt64(site.size), rt, profile);
+    unprofiledCount++;
+    return "guarded";
+  }
+
+  Instruction *thenTerm =
+      site.pmem ? emitTrackingCheck(si, rt) : emitRangeCheck(si, ptr, rt);
+  IRBuilder<> thenIrb(thenTerm);
+  if (const auto fixed = rt.logMemoryFixed.find(site.size);
+      fixed != rt.logMemoryFixed.end()) {
+    thenIrb.CreateCall(fixed->second, ArrayRef<Value *>(ptr));
+  } else {
+    thenIrb.CreateCall(rt.logMemoryN, {ptr, thenIrb.getInt64(site.size)});
+  }
+
+  emitSiteHooks(thenTerm, site.id, thenIrb.getInt64(site.size), rt, profile);
+  modCount++;
+  return site.pmem ? "known-pmem" : site.widened ? "checked-merged" : "checked";
+}
+
+/**
+ * @brief Instrument a memset/memcpy/memmove with one range check on its
+ * destination
+ *
+ * @details Logs the intrinsic's length operand, so bulk writes no longer rely
+ * on the libc wrappers, which miss intrinsics expanded into plain stores.
+ */
+const char *instrumentMemIntrinsic(MemIntrinsic *mi, uint64_t id, bool pmem,
+                                   RuntimeSyms &rt,
+                                   const SiteProfile &profile) {
+  Type *VoidPtrType = Type::getInt8PtrTy(mi->getContext());
+  IRBuilder<> irb(mi);
+
+  Value *ptr = irb.CreatePointerCast(mi->getRawDest(), VoidPtrType);
+  auto getLen = [mi](IRBuilder<> &b) {
+    return b.CreateZExtOrTrunc(mi->getLength(), b.getInt64Ty());
+  };
+
+  if (not pmem and profile.neverSeen(id)) {
+    Instruction *thenTerm = emitRangeGuard(mi, ptr, rt);
+    IRBuilder<> thenIrb(thenTerm);
+    Value *len = getLen(thenIrb);
+    thenIrb.CreateCall(rt.logMemoryUnprofiled, {ptr, len});
+    emitSiteHooks(thenTerm, id, len, rt, profile);
+    unprofiledCount++;
+    return "guarded";
+  }
+
+  Instruction *thenTerm =
+      pmem ? emitTrackingCheck(mi, rt) : emitRangeCheck(mi, ptr, rt);
+  IRBuilder<> thenIrb(thenTerm);
+  Value *len = getLen(thenIrb);
+  thenIrb.CreateCall(rt.logMemoryN, {ptr, len});
+  emitSiteHooks(thenTerm, id, len, rt, profile);
+  memIntrinsicCount++;
+  return pmem ? "known-pmem" : "checked";
+}
+
+/** @brief An atomic store, RMW or cmpxchg planned for instrumentation */
+struct AtomicSite {
+  Instruction *inst;
+  Value *ptr;
+  uint64_t size;
+  /** @brief Stable site ID, see getSiteId() */
+  uint64_t id;
+  /** @brief Known to point to PMEM, no range check needed */
+  bool pmem;
+};
+
+/**
+ * @brief Get the pointer and width written by an atomic instruction
+ * @return false if @p i doesn't atomically write memory
+ */
+static bool getAtomicAccess(Instruction *i, Value *&ptr, uint64_t &size) {
+  const DataLayout &dl = i->getModule()->getDataLayout();
+  Type *ty = nullptr;
+
+  if (auto *si = dyn_cast<StoreInst>(i); si and si->isAtomic()) {
+    ptr = si->getPointerOperand();
+    ty = si->getValueOperand()->getType();
+  } else if (auto *rmw = dyn_cast<AtomicRMWInst>(i)) {
+    ptr = rmw->getPointerOperand();
+    ty = rmw->getValOperand()->getType();
+  } else if (auto *cas = dyn_cast<AtomicCmpXchgInst>(i)) {
+    ptr = cas->getPointerOperand();
+    ty = cas->getNewValOperand()->getType();
+  } else {
+    return false;
+  }
+
+  size = dl.getTypeStoreSize(ty).getFixedSize();
+  return true;
+}
+
+/**
+ * @brief Instrument an atomic write with the full inline check
+ *
+ * @details The runtime's atomic entry point reads the old value untorn and
+ * publishes the log entry before returning, so any thread that observes the
+ * atomic's result also observes the entry. Atomic sites ignore the profile, a
+ * cheap guard would skip the tracking check the runtime relies on.
+ */
+const char *instrumentAtomic(const AtomicSite &site, RuntimeSyms &rt,
+                             const SiteProfile &profile) {
+  Type *VoidPtrType = Type::getInt8PtrTy(site.inst->getContext());
+  IRBuilder<> irb(site.inst);
+
+  Value *ptr = irb.CreatePointerCast(site.ptr, VoidPtrType);
+  Instruction *thenTerm = site.pmem ? emitTrackingCheck(site.inst, rt)
+                                    : emitRangeCheck(site.inst, ptr, rt);
+  IRBuilder<> thenIrb(thenTerm);
+  thenIrb.CreateCall(rt.logMemoryAtomic, {ptr, thenIrb.getInt64(site.size)});
+  emitSiteHooks(thenTerm, site.id, thenIrb.getInt64(site.size), rt, profile);
+  atomicCount++;
+  return site.pmem ? "known-pmem" : "checked";
+}
+
+/**
+ * @brief A masked, compressing or scalable vector store planned for
+ * instrumentation, logged as one range from @p ptr
+ */
+struct VectorSite {
+  Instruction *inst;
+  Value *ptr;
+  /** @brief Bytes written, times vscale if @p scalable */
+  uint64_t size;
+  bool scalable;
+  /** @brief Stable site ID, see getSiteId() */
+  uint64_t id;
+  /** @brief Known to point to PMEM, no range check needed */
+  bool pmem;
+};
+
+/**
+ * @brief Get the range a vector store writes, at most
+ *
+ * @details For masked and compressing stores this is the whole vector, the
+ * part actually written depends on the mask, see instrumentVector(). Scatters
+ * are not ranges, see instrumentScatter().
+ *
+ * @return false if @p i isn't one of these stores
+ */
+static bool getVectorAccess(Instruction *i, Value *&ptr, TypeSize &size) {
+  const DataLayout &dl = i->getModule()->getDataLayout();
+  Type *ty = nullptr;
+
+  if (auto *si = dyn_cast<StoreInst>(i)) {
+    ty = si->getValueOperand()->getType();
+    if (not isa<ScalableVectorType>(ty)) return false;
+
+    ptr = si->getPointerOperand();
+  } else if (auto *ii = dyn_cast<IntrinsicInst>(i)) {
+    const Intrinsic::ID iid = ii->getIntrinsicID();
+    if (iid != Intrinsic::masked_store and
+        iid != Intrinsic::masked_compressstore) {
+      return false;
+    }
+
+    /* Nothing is written with an all-false mask */
+    const unsigned maskIdx = iid == Intrinsic::masked_store ? 3 : 2;
+    if (const auto *mask = dyn_cast<Constant>(ii->getArgOperand(maskIdx));
+        mask and mask->isNullValue()) {
+      return false;
+    }
+
+    ty = ii->getArgOperand(0)->getType();
+    ptr = ii->getArgOperand(1);
+  } else {
+    return false;
+  }
+
+  size = dl.getTypeStoreSize(ty);
+  return true;
+}
+
+/** @brief Check if @p i is a scatter with fixed-width vectors */
+static bool isFixedScatter(const Instruction *i) {
+  const auto *ii = dyn_cast<IntrinsicInst>(i);
+  return ii and ii->getIntrinsicID() == Intrinsic::masked_scatter and
+         isa<FixedVectorType>(ii->getArgOperand(0)->getType()) and
+         cast<FixedVectorType>(ii->getArgOperand(0)->getType())
+                 ->getNumElements() <= 64;
+}
+
+/**
+ * @brief Emit the part of a masked or compressing store @p ii writes
+ *
+ * @details A masked store writes its enabled lanes, the range runs from the
+ * first to the last one (the lanes in between are read, not written). A
+ * compressing store writes popcount(mask) elements packed from its pointer.
+ * Neither reaches past its last written byte, e.g., for a vectorized loop's
+ * tail at the end of the mapping.
+ *
+ * @param[in,out] ptr Start of the range, i8*
+ * @return Bytes written, i64, zero if no lane is enabled
+ */
+static Value *emitMaskedRange(IRBuilder<> &irb, IntrinsicInst *ii,
+                              Value *&ptr) {
+  const DataLayout &dl = ii->getModule()->getDataLayout();
+  const bool compress =
+      ii->getIntrinsicID() == Intrinsic::masked_compressstore;
+  auto *vecTy = cast<VectorType>(ii->getArgOperand(0)->getType());
+  const uint64_t elemSize =
+      dl.getTypeStoreSize(vecTy->getElementType()).getFixedSize();
+  auto *idxTy = VectorType::get(irb.getInt64Ty(), vecTy->getElementCount());
+  Value *mask = ii->getArgOperand(compress ? 2 : 3);
+
+  Value *lanes;
+  if (compress) {
+    lanes = irb.CreateAddReduce(irb.CreateZExt(mask, idxTy));
+  } else {
+    Value *idx = irb.CreateStepVector(idxTy);
+    Value *last = irb.CreateIntMaxReduce(
+        irb.CreateSelect(mask, irb.CreateAdd(idx, ConstantInt::get(idxTy, 1)),
+                         Constant::getNullValue(idxTy)));
+    Value *first = irb.CreateIntMinReduce(
+        irb.CreateSelect(mask, idx, Constant::getAllOnesValue(idxTy)));
+
+    /* No lane enabled: first is all ones, the range is empty */
+    first = irb.CreateBinaryIntrinsic(Intrinsic::umin, first, last);
+    ptr = irb.CreateGEP(irb.getInt8Ty(), ptr,
+                        irb.CreateMul(first, irb.getInt64(elemSize)));
+    lanes = irb.CreateSub(last, first);
+  }
+
+  return irb.CreateMul(lanes, irb.getInt64(elemSize), "sip.len");
+}
+
+/** @brief Instrument a vector store with one range check on the bytes it
+ * writes */
+const char *instrumentVector(const VectorSite &site, RuntimeSyms &rt,
+                             const SiteProfile &profile) {
+  Type *VoidPtrType = Type::getInt8PtrTy(site.inst->getContext());
+  IRBuilder<> irb(site.inst);
+
+  Value *ptr = irb.CreatePointerCast(site.ptr, VoidPtrType);
+  auto *masked = dyn_cast<IntrinsicInst>(site.inst);
+  Value *len = masked ? emitMaskedRange(irb, masked, ptr)
+               : site.scalable ? irb.CreateVScale(irb.getInt64(site.size))
+                               : irb.getInt64(site.size);
+  Value *nonEmpty =
+      masked ? irb.CreateICmpNE(len, irb.getInt64(0)) : nullptr;
+
+  Instruction *thenTerm =
+      site.pmem ? emitTrackingCheck(site.inst, rt)
+                : emitRangeCheck(site.inst, ptr, rt, nonEmpty, len);
+  IRBuilder<> thenIrb(thenTerm);
+
+  if (site.pmem) {
+    thenIrb.CreateCall(rt.logMemoryN, {ptr, len});
+  } else {
+    /* The range check only saw some byte hit, log the bytes inside */
+    len = emitClampedLog(thenTerm, ptr, len, rt);
+  }
+
+  emitSiteHooks(thenTerm, site.id, len, rt, profile);
+  vectorCount++;
+  return site.pmem ? "known-pmem" : "checked";
+}
+
+/**
+ * @brief Instrument a scatter with a per-lane range check
+ *
+ * @details The lanes are checked with vector compares and or-reduced, so the
+ * hot path has no call. On a hit, the runtime gets the pointers and the bitmask
+ * of the enabled lanes that hit the range and logs them in one call, merging
+ * lanes that write adjacent elements.
+ */
+const char *instrumentScatter(IntrinsicInst *ii, uint64_t id, RuntimeSyms &rt,
+                              const SiteProfile &profile) {
+  LLVMContext &c = ii->getContext();
+  const DataLayout &dl = ii->getModule()->getDataLayout();
+  auto *valTy = cast<FixedVectorType>(ii->getArgOperand(0)->getType());
+  const unsigned lanes = valTy->getNumElements();
+  const uint64_t elemSize =
+      dl.getTypeStoreSize(valTy->getElementType()).getFixedSize();
+  Type *VoidPtrType = Type::getInt8PtrTy(c);
+  auto *ptrsTy = FixedVectorType::get(VoidPtrType, lanes);
+  auto *intsTy = FixedVectorType::get(Type::getInt64Ty(c), lanes);
+
+  /* Slot for the pointers, only written on the cold path */
+  IRBuilder<> entryIrb(&*ii->getFunction()->getEntryBlock().begin());
+  AllocaInst *slot = entryIrb.CreateAlloca(ptrsTy, nullptr, "sip.scatter");
+
+  IRBuilder<> irb(ii);
+  Value *ptrs = irb.CreatePointerCast(ii->getArgOperand(1), ptrsTy);
+  Value *ints = irb.CreatePtrToInt(ptrs, intsTy);
+  Value *start = irb.CreateVectorSplat(
+      lanes, irb.CreatePtrToInt(irb.CreateLoad(VoidPtrType, rt.startAddr),
+                                irb.getInt64Ty()));
+  Value *end = irb.CreateVectorSplat(
+      lanes, irb.CreatePtrToInt(irb.CreateLoad(VoidPtrType, rt.endAddr),
+                                irb.getInt64Ty()));
+  Value *laneHit = irb.CreateAnd(
+      ii->getArgOperand(3),
+      irb.CreateAnd(irb.CreateICmpULE(start, ints),
+                    irb.CreateICmpULT(ints, end)));
+  Value *tracking = irb.CreateICmpNE(
+      irb.CreateLoad(irb.getInt8Ty(), rt.startTracking, "sip.tracking"),
+      irb.getInt8(0));
+  Value *hit =
+      irb.CreateAnd(tracking, irb.CreateOrReduce(laneHit), "sip.hit");
+
+  MDNode *weights = MDBuilder(c).createBranchWeights(1, 1 << 20);
+  Instruction *thenTerm = SplitBlockAndInsertIfThen(hit, ii, false, weights);
+
+  IRBuilder<> thenIrb(thenTerm);
+  thenIrb.CreateStore(ptrs, slot);
+  Value *laneMask = thenIrb.CreateZExt(
+      thenIrb.CreateBitCast(laneHit, thenIrb.getIntNTy(lanes)),
+      thenIrb.getInt64Ty());
+  thenIrb.CreateCall(rt.logMemoryScatter,
+                     {thenIrb.CreatePointerCast(slot,
+                                                VoidPtrType->getPointerTo()),
+                      laneMask, thenIrb.getInt64(lanes),
+                      thenIrb.getInt64(elemSize)});
+
+  emitSiteHooks(thenTerm, id, thenIrb.getInt64(elemSize * lanes), rt, profile);
+  vectorCount++;
+  return "checked";
+}
+
+/** @brief Check if @p i is a direct store, RMW or cmpxchg to @p tracking */
+static bool writesTracking(const Instruction &i, const Value *tracking) {
+  if (const auto *si = dyn_cast<StoreInst>(&i)) {
+    return getUnderlyingObject(si->getPointerOperand()) == tracking;
+  } else if (const auto *rmw = dyn_cast<AtomicRMWInst>(&i)) {
+    return getUnderlyingObject(rmw->getPointerOperand()) == tracking;
+  } else if (const auto *cas = dyn_cast<AtomicCmpXchgInst>(&i)) {
+    return getUnderlyingObject(cas->getPointerOperand()) == tracking;
+  }
+
+  return false;
+}
+
+/**
+ * @brief Check if @p i could snapshot (msync) the log
+ *
+ * @details Calls could, and so could a write to startTracking (@p tracking):
+ * sites before it ran untracked and logged nothing, so they can't stand in
+ * for the sites after it.
+ */
+static bool maySnapshot(const Instruction &i, const Value *tracking) {
+  return (isa<CallBase>(i) and not isa<IntrinsicInst>(i)) or
+         writesTracking(i, tracking);
+}
+
+/**
+ * @brief Check that no path from @p from to @p to has an instruction that could
+ * snapshot the log
+ * @details @p from must dominate @p to, so walking back from @p to always ends
+ * at the block of @p from
+ */
+static bool noSnapshotBetween(const Instruction *from, const Instruction *to,
+                              const Value *tracking) {
+  const BasicBlock *fromBB = from->getParent();
+  const BasicBlock *toBB = to->getParent();
+
+  if (fromBB == toBB and from->comesBefore(to)) {
+    for (auto it = std::next(from->getIterator()); &*it != to; ++it) {
+      if (maySnapshot(*it, tracking)) return false;
+    }
+    return true;
+  }
+
+  for (auto it = toBB->begin(); &*it != to; ++it) {
+    if (maySnapshot(*it, tracking)) return false;
+  }
+
+  for (auto it = std::next(from->getIterator()); it != fromBB->end(); ++it) {
+    if (maySnapshot(*it, tracking)) return false;
+  }
+
+  SmallPtrSet<const BasicBlock *, 16> visited;
+  SmallVector<const BasicBlock *, 16> worklist(pred_begin(toBB),
+                                               pred_end(toBB));
+
+  while (not worklist.empty()) {
+    const BasicBlock *bb = worklist.pop_back_val();
+
+    if (bb == fromBB or not visited.insert(bb).second) continue;
+
+    for (const Instruction &i : *bb) {
+      if (maySnapshot(i, tracking)) return false;
+    }
+
+    worklist.append(pred_begin(bb), pred_end(bb));
+  }
+
+  return true;
+}
+
+/**
+ * @brief Merge stores to neighbouring fields in a block into one log call
+ *
+ * @details The first store of a run logs the whole range, the old values of the
+ * later stores are copied before they are overwritten so the undo log stays
+ * correct. A call or startTracking write that could snapshot ends the run.
+ */
+static void mergeAdjacentSites(std::vector<LogSite> &sites,
+                               const Value *tracking) {
+  std::unordered_map<const Value *, size_t> leaders;
+  const BasicBlock *curBB = nullptr;
+  const Instruction *prev = nullptr;
+
+  for (size_t idx = 0; idx < sites.size(); idx++) {
+    LogSite &site = sites[idx];
+
+    /* Sites are in program order, look for snapshots since the previous one */
+    bool reset = site.si->getParent() != curBB;
+    for (auto it = prev ? std::next(prev->getIterator())
+                        : site.si->getParent()->begin();
+         not reset and &*it != site.si; ++it) {
+      reset |= maySnapshot(*it, tracking);
+    }
+
+    if (reset) leaders.clear();
+    curBB = site.si->getParent();
+    prev = site.si;
+
+    auto leaderIt = leaders.find(site.base);
+    if (leaderIt == leaders.end()) {
+      leaders[site.base] = idx;
+      continue;
+    }
+
+    LogSite &leader = sites[leaderIt->second];
+    const int64_t lo = std::min(leader.offset, site.offset);
+    const int64_t hi = std::max(leader.offset + (int64_t)leader.size,
+                                site.offset + (int64_t)site.size);
+
+    if ((uint64_t)(hi - lo) <= MaxMergedLogSize) {
+      if (not leader.covers(site)) {
+        leader.offset = lo;
+        leader.size = hi - lo;
+        leader.widened = true;
+        mergedCount++;
+      } else {
+        redundantCount++;
+      }
+      site.eliminated = true;
+    } else {
+      leaders[site.base] = idx;
+    }
+  }
+}
+
+/**
+ * @brief Drop sites whose range is already logged on every path since the last
+ * instruction that could snapshot
+ */
+static void eliminateRedundantSites(FuncAnalyses &fa,
+                                    std::vector<LogSite> &sites,
+                                    const Value *tracking) {
+  std::unordered_map<const Value *, std::vector<size_t>> byBase;
+  for (size_t idx = 0; idx < sites.size(); idx++) {
+    if (not sites[idx].eliminated) byBase[sites[idx].base].push_back(idx);
+  }
+
+  for (auto &[base, group] : byBase) {
+    for (const size_t later : group) {
+      for (const size_t earlier : group) {
+        const LogSite &dom = sites[earlier];
+        LogSite &site = sites[later];
+
+        if (earlier == later or dom.eliminated or
+            not dom.covers(site) or
+            not fa.dt.dominates(dom.si, site.si) or
+            not noSnapshotBetween(dom.si, site.si, tracking)) {
+          continue;
+        }
+
+        site.eliminated = true;
+        redundantCount++;
+        break;
+      }
+    }
+  }
+}
+
+/** @brief Check if @p l has an instruction that could snapshot (msync) the
+ * log */
+static bool loopMaySnapshot(const Loop *l, const Value *tracking) {
+  for (const BasicBlock *bb : l->blocks()) {
+    for (const Instruction &i : *bb) {
+      if (maySnapshot(i, tracking)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief Check if the addresses written by @p si in its loop form a range that
+ * can be logged once in the loop's preheader
+ *
+ * @details The store needs an affine address with a stride of its own size,
+ * so the iterations write a contiguous range (a larger stride would log and
+ * apply the gaps). The loop needs a computable trip count and no calls or
+ * writes to startTracking (@p tracking, a snapshot in the loop would drop the
+ * log before later iterations write). The store must also execute on every
+ * iteration, otherwise the range could include memory it never touches.
+ */
+bool getLoopRange(FuncAnalyses &fa, StoreInst *si, const Value *tracking,
+                  LoopRange &result) {
+  Loop *l = fa.li.getLoopFor(si->getParent());
+
+  if (not l or not si->isSimple() or not l->getLoopPreheader() or
+      not l->getLoopLatch()) {
+    return false;
+  }
+
+  const auto *ptr =
+      dyn_cast<SCEVAddRecExpr>(fa.se.getSCEV(si->getPointerOperand()));
+  if (not ptr or ptr->getLoop() != l or not ptr->isAffine()) {
+    return false;
+  }
+
+  const auto *step = dyn_cast<SCEVConstant>(ptr->getStepRecurrence(fa.se));
+  const uint64_t size = getStoreSize(si);
+  if (not step or step->getAPInt().abs() != size) {
+    return false;
+  }
+
+  const SCEV *btc = fa.se.getBackedgeTakenCount(l);
+  if (isa<SCEVCouldNotCompute>(btc) or loopMaySnapshot(l, tracking)) {
+    return false;
+  }
+
+  const BasicBlock *bb = si->getParent();
+  if (not fa.dt.dominates(bb, l->getLoopLatch())) {
+    return false;
+  }
+
+  SmallVector<BasicBlock *, 4> exiting;
+  l->getExitingBlocks(exiting);
+
+  bool domsExits = true;
+  for (const BasicBlock *exit : exiting) {
+    domsExits &= fa.dt.dominates(bb, exit);
+  }
+
+  /* Store executes on the last iteration only if it's before every exit,
+     otherwise only handle the loop exiting from its header (for-loop shape) */
+  if (not domsExits and
+      (exiting.size() != 1 or exiting.front() != l->getHeader())) {
+    return false;
+  }
+
+  Type *i64 = Type::getInt64Ty(si->getContext());
+  const SCEV *count = fa.se.getNoopOrZeroExtend(btc, i64);
+  if (domsExits) {
+    count = fa.se.getAddExpr(count, fa.se.getOne(i64));
+  }
+
+  if (not isSafeToExpandAt(ptr->getStart(),
+                           l->getLoopPreheader()->getTerminator(), fa.se) or
+      not isSafeToExpandAt(count, l->getLoopPreheader()->getTerminator(),
+                           fa.se)) {
+    return false;
+  }
+
+  result = {si, 0, l, ptr, count, step->getAPInt().getSExtValue(), size};
+  return true;
+}
+
+/**
+ * @brief Log the whole range a loop store writes with one call in the loop's
+ * preheader
+ */
+void instrumentLoopRange(const LoopRange &lr, FuncAnalyses &fa,
+                         RuntimeSyms &rt, const SiteProfile &profile) {
+  LLVMContext &c = lr.si->getContext();
+  Instruction *insertPt = lr.loop->getLoopPreheader()->getTerminator();
+  const DataLayout &dl = lr.si->getModule()->getDataLayout();
+
+  SCEVExpander expander(fa.se, dl, "sip.loop");
+  Value *start =
+      expander.expandCodeFor(lr.ptr->getStart(), nullptr, insertPt);
+  Value *count = expander.expandCodeFor(lr.count, nullptr, insertPt);
+
+  IRBuilder<> irb(insertPt);
+  Value *base = irb.CreatePointerCast(start, Type::getInt8PtrTy(c));
+
+  /* Range is [base, base + (count-1)*|step| + size), starting at the last
+     iteration's address for negative strides */
+  Value *lastIter = irb.CreateSub(count, irb.getInt64(1));
+  Value *len =
+      irb.CreateAdd(irb.CreateMul(lastIter, irb.getInt64(std::abs(lr.step))),
+                    irb.getInt64(lr.size), "sip.len");
+  if (lr.step < 0) {
+    base = irb.CreateGEP(irb.getInt8Ty(), base,
+                         irb.CreateMul(lastIter, irb.getInt64(lr.step)));
+  }
+
+  Value *nonEmpty = irb.CreateICmpNE(count, irb.getInt64(0));
+  Instruction *thenTerm = emitRangeCheck(insertPt, base, rt, nonEmpty, len);
+
+  /* The range can start before or end after the tracked range, only log the
+     part inside it */
+  Value *clampedLen = emitClampedLog(thenTerm, base, len, rt);
+  emitSiteHooks(thenTerm, lr.id, clampedLen, rt, profile);
+}
+
+/** @return true if the function was modified */
+bool analyseFunc(FuncAnalyses &fa, const NonPmemInfo &nonPmem,
+                 const PmemInfo &pmem, Function &f, RuntimeSyms &rt,
+                 const SiteProfile &profile, SiteReport &report) {
   std::unordered_map<Value *, bool> stackValues;
+  std::vector<LogSite> targets;
+  std::vector<LoopRange> loopRanges;
+  std::vector<std::tuple<MemIntrinsic *, uint64_t, bool>> memOps;
+  std::vector<AtomicSite> atomics;
+  std::vector<VectorSite> vectors;
+  std::vector<std::pair<IntrinsicInst *, uint64_t>> scatters;
+  size_t storeOrdinal = 0;
+  const Value *tracking = rt.startTracking->stripPointerCasts();
 
   for (Function::iterator bi = f.begin(); bi != f.end(); bi++) {
     for (BasicBlock::iterator it = bi->begin(); it != bi->end(); it++) {
       Instruction *i = &*it;
+      Value *atomicPtr = nullptr, *vectorPtr = nullptr;
+      uint64_t atomicSize = 0;
+      TypeSize vectorSize = TypeSize::getFixed(0);
 
-      if (StoreInst *si = dyn_cast<StoreInst>(i)) {
-        Value *ptr = si->getPointerOperand();
+      if (getVectorAccess(i, vectorPtr, vectorSize)) {
+        const uint64_t siteId = getSiteId(f, storeOrdinal++);
+        const uint64_t size = vectorSize.getKnownMinSize();
+        const bool isPmem = pmem.isPmem(vectorPtr);
 
-        /* Don't instrument stack operations */
-        if (not writesToStackLocation(aa, si, stackValues)) {
-          LLVMContext &c = si->getContext();
-          ptr = new BitCastInst(ptr, Type::getInt8PtrTy(c), ptr->getName(), si);
+        if (nonPmem.isNonPmem(vectorPtr)) {
+          report.add(i, siteId, "vector", size, "non-pmem");
+          nonPmemCount++;
+        } else if (pmem.strict and not isPmem) {
+          report.add(i, siteId, "vector", size, "unmarked");
+          unmarkedCount++;
+        } else {
+          vectors.push_back({i, vectorPtr, size, vectorSize.isScalable(),
+                             siteId, isPmem});
+        }
+      } else if (isFixedScatter(i)) {
+        const uint64_t siteId = getSiteId(f, storeOrdinal++);
+        auto *ii = cast<IntrinsicInst>(i);
+
+        /* Skipped only if every lane's pointer is known not to be PMEM */
+        if (nonPmem.isNonPmem(ii->getArgOperand(1))) {
+          report.add(i, siteId, "scatter", 0, "non-pmem");
+          nonPmemCount++;
+        } else if (pmem.strict) {
+          report.add(i, siteId, "scatter", 0, "unmarked");
+          unmarkedCount++;
+        } else {
+          scatters.emplace_back(ii, siteId);
+        }
+      } else if (getAtomicAccess(i, atomicPtr, atomicSize)) {
+        const uint64_t siteId = getSiteId(f, storeOrdinal++);
 
-          CallInst::Create(checkMemory, ArrayRef<Value *>(ptr), "", si);
-          modCount++;
+        /* Atomics are never merged or coalesced, the runtime has to log each
+           one right before it happens */
+        const bool isPmem = pmem.isPmem(atomicPtr);
+        if (nonPmem.isNonPmem(atomicPtr)) {
+          report.add(i, siteId, "atomic", atomicSize, "non-pmem");
+          nonPmemCount++;
+        } else if (pmem.strict and not isPmem) {
+          report.add(i, siteId, "atomic", atomicSize, "unmarked");
+          unmarkedCount++;
         } else {
+          atomics.push_back({i, atomicPtr, atomicSize, siteId, isPmem});
+        }
+      } else if (StoreInst *si = dyn_cast<StoreInst>(i)) {
+        LoopRange lr;
+        const uint64_t siteId = getSiteId(f, storeOrdinal++);
+
+        const uint64_t size = getStoreSize(si);
+
+        /* Don't instrument stack operations */
+        if (writesToStackLocation(fa.aa, si, stackValues)) {
+          report.add(si, siteId, "store", size, "stack");
           skipCount++;
+        } else if (nonPmem.isNonPmem(si->getPointerOperand())) {
+          report.add(si, siteId, "store", size, "non-pmem");
+          nonPmemCount++;
+        } else if (pmem.strict and not pmem.isPmem(si->getPointerOperand())) {
+          report.add(si, siteId, "store", size, "unmarked");
+          unmarkedCount++;
+        } else if (getLoopRange(fa, si, tracking, lr)) {
+          lr.id = siteId;
+          report.add(si, siteId, "store", size, "loop-coalesced");
+          loopRanges.push_back(lr);
+        } else {
+          targets.push_back(
+              makeLogSite(si, siteId, pmem.isPmem(si->getPointerOperand())));
+        }
+      } else if (MemIntrinsic *mi = dyn_cast<MemIntrinsic>(i)) {
+        const uint64_t siteId = getSiteId(f, storeOrdinal++);
+        const auto *len = dyn_cast<ConstantInt>(mi->getLength());
+
+        const uint64_t size = len ? len->getZExtValue() : 0;
+
+        const bool isPmem = pmem.isPmem(mi->getRawDest());
+        if (nonPmem.isNonPmem(mi->getRawDest())) {
+          report.add(mi, siteId, "mem-intrinsic", size, "non-pmem");
+          nonPmemCount++;
+        } else if (pmem.strict and not isPmem) {
+          report.add(mi, siteId, "mem-intrinsic", size, "unmarked");
+          unmarkedCount++;
+        } else if (len and len->isZero()) {
+          report.add(mi, siteId, "mem-intrinsic", size, "empty");
+        } else {
+          memOps.emplace_back(mi, siteId, isPmem);
         }
       } else if (AllocaInst *ai = dyn_cast<AllocaInst>(i)) {
         stackValues[ai] = true;
       }
     }
   }
+
+  /* Instrumenting splits the blocks, so do it after the walk. Expand the loop
+     ranges first, while the loop analyses are still valid */
+  for (const LoopRange &lr : loopRanges) {
+    instrumentLoopRange(lr, fa, rt, profile);
+    loopCoalescedCount++;
+  }
+
+  mergeAdjacentSites(targets, tracking);
+  eliminateRedundantSites(fa, targets, tracking);
+
+  for (const LogSite &site : targets) {
+    const char *action =
+        site.eliminated ? "covered" : instrumentStore(site, rt, profile);
+    report.add(site.si, site.id, "store", getStoreSize(site.si), action);
+  }
+
+  for (auto &[mi, siteId, isPmem] : memOps) {
+    const auto *len = dyn_cast<ConstantInt>(mi->getLength());
+    const uint64_t size = len ? len->getZExtValue() : 0;
+
+    report.add(mi, siteId, "mem-intrinsic", size,
+               instrumentMemIntrinsic(mi, siteId, isPmem, rt, profile));
+  }
+
+  for (const AtomicSite &site : atomics) {
+    report.add(site.inst, site.id, "atomic", site.size,
+               instrumentAtomic(site, rt, profile));
+  }
+
+  for (const VectorSite &site : vectors) {
+    report.add(site.inst, site.id, "vector", site.size,
+               instrumentVector(site, rt, profile));
+  }
+
+  for (auto &[ii, siteId] : scatters) {
+    report.add(ii, siteId, "scatter", 0,
+               instrumentScatter(ii, siteId, rt, profile));
+  }
+
+  return not (targets.empty() and loopRanges.empty() and memOps.empty() and
+              atomics.empty() and vectors.empty() and scatters.empty());
+}
+
+/**
+ * @brief Functions that may set startTracking, directly or through a call
+ *
+ * @details Only direct stores to startTracking are considered, the runtime and
+ * the applications never take its address. Calls through pointers, inline asm
+ * and calls to external functions that are not known library functions may
+ * set it.
+ */
+static SmallPtrSet<const Function *, 32>
+getTrackingWriters(Module &m, const RuntimeSyms &rt,
+                   const NonPmemInfo::GetTLI &getTLI) {
+  SmallPtrSet<const Function *, 32> writers;
+  const Value *tracking = rt.startTracking->stripPointerCasts();
+
+  auto mayWrite = [&](const Instruction &i, const TargetLibraryInfo &tli) {
+    if (writesTracking(i, tracking)) return true;
+
+    const auto *cb = dyn_cast<CallBase>(&i);
+    if (not cb or isa<IntrinsicInst>(cb)) return false;
+
+    const Function *callee = cb->getCalledFunction();
+    if (not callee or cb->isInlineAsm()) return true;
+
+    LibFunc lf;
+    if (callee->isDeclaration()) {
+      return not (tli.getLibFunc(*callee, lf) and tli.has(lf));
+    }
+
+    return writers.count(callee) != 0;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (Function &f : m) {
+      if (f.isDeclaration() or writers.count(&f)) continue;
+
+      const TargetLibraryInfo &tli = getTLI(f);
+      for (const Instruction &i : instructions(f)) {
+        if (mayWrite(i, tli)) {
+          writers.insert(&f);
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return writers;
+}
+
+/**
+ * @brief Check if @p f can have an uninstrumented clone
+ *
+ * @details Functions with loops are never cloned: the clone is only chosen on
+ * entry, so a loop in it would keep storing unlogged after another thread
+ * turns tracking on. Without loops, the clone returns (or calls a function
+ * that dispatches on its own entry) after a bounded number of stores.
+ */
+static bool isCloneable(const Function &f,
+                        const SmallPtrSet<const Function *, 32> &writers) {
+  if (f.isVarArg() or f.hasFnAttribute(Attribute::Naked) or
+      writers.count(&f)) {
+    return false;
+  }
+
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> backedges;
+  FindFunctionBackedges(f, backedges);
+  if (not backedges.empty()) {
+    return false;
+  }
+
+  for (const Argument &arg : f.args()) {
+    if (arg.hasInAllocaAttr() or arg.hasPreallocatedAttr() or
+        arg.hasSwiftErrorAttr()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Dispatch @p f to its uninstrumented clone while tracking is off
+ *
+ * @details Adds a check of startTracking to the entry block (after the
+ * allocas), the clone runs when it is false. Only used for functions that
+ * can't set startTracking themselves and have no loops (see isCloneable()),
+ * so a clone running when another thread turns tracking on only misses the
+ * stores of its current, loop-free, call.
+ */
+static void addCleanDispatch(Function &f, Function &clean, RuntimeSyms &rt) {
+  BasicBlock *entry = &f.getEntryBlock();
+  BasicBlock::iterator splitPt = entry->getFirstInsertionPt();
+  while (isa<AllocaInst>(*splitPt)) ++splitPt;
+
+  BasicBlock *body = SplitBlock(entry, &*splitPt);
+  BasicBlock *cleanBB =
+      BasicBlock::Create(f.getContext(), "sip.clean", &f, body);
+
+  /* Replace the unconditional branch from SplitBlock with the dispatch */
+  entry->getTerminator()->eraseFromParent();
+  IRBuilder<> irb(entry);
+  Value *tracking =
+      irb.CreateLoad(irb.getInt8Ty(), rt.startTracking, "sip.tracking");
+  irb.CreateCondBr(irb.CreateICmpNE(tracking, irb.getInt8(0)), body, cleanBB);
+
+  IRBuilder<> cleanIrb(cleanBB);
+  /* The verifier wants a location on inlinable calls in functions with debug
+     info */
+  if (DISubprogram *sp = f.getSubprogram()) {
+    cleanIrb.SetCurrentDebugLocation(
+        DILocation::get(f.getContext(), sp->getLine(), 0, sp));
+  }
+
+  SmallVector<Value *, 8> args;
+  for (Argument &arg : f.args()) {
+    args.push_back(&arg);
+  }
+
+  CallInst *call = cleanIrb.CreateCall(&clean, args);
+  call->setAttributes(f.getAttributes());
+  call->setTailCall();
+
+  if (f.getReturnType()->isVoidTy()) {
+    cleanIrb.CreateRetVoid();
+  } else {
+    cleanIrb.CreateRet(call);
+  }
 }
 
 // New PM implementation
@@ -161,26 +1680,89 @@ struct HelloWorld : PassInfoMixin<HelloWorld> {
 
   HelloWorld(void *ptr) {}
   PreservedAnalyses run(Module &m, ModuleAnalysisManager &mam) {
-    FunctionCallee checkMemory = createRuntimeCheckFunc(m);
+    RuntimeSyms rt = createRuntimeSyms(m);
+    const SiteProfile profile = SiteProfile::fromEnv();
     FunctionAnalysisManager &fam =
         mam.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
 
     auto annotFuncs = getAnnotatedFunctions(&m);
 
-    for (auto fi = m.begin(); fi != m.end(); ++fi) {
-      auto &f = *fi;
-      if (not fi->empty() and annotFuncs.find(&f) == annotFuncs.end()) {
-        assert(not fam.empty());
-        auto demangledName = demangleSym(fi->getName().str());
-        auto &aam = fam.getResult<AAManager>(*fi);
-        analyseFunc(aam, *fi, checkMemory);
+    /* Computed before instrumenting, the module is still unmodified */
+    const NonPmemInfo::GetTLI getTLI =
+        [&](Function &f) -> const TargetLibraryInfo & {
+      return fam.getResult<TargetLibraryAnalysis>(f);
+    };
+    const NonPmemInfo nonPmem(m, getTLI);
+    const PmemInfo pmem(m);
+    SiteReport report;
+
+    const bool cloneEnabled = getenv("DCLANG_NO_CLONE") == nullptr;
+    SmallPtrSet<const Function *, 32> trackingWriters;
+    if (cloneEnabled) {
+      trackingWriters = getTrackingWriters(m, rt, getTLI);
+    }
+
+    /* Clones are added to the module as we go, don't visit them */
+    std::vector<Function *> funcs;
+    for (Function &f : m) {
+      if (not f.empty() and annotFuncs.find(&f) == annotFuncs.end()) {
+        funcs.push_back(&f);
+      }
+    }
+
+    for (Function *fp : funcs) {
+      auto &f = *fp;
+      assert(not fam.empty());
+
+      /* Clone before instrumenting, the clone keeps the original body */
+      Function *clean = nullptr;
+      if (cloneEnabled and isCloneable(f, trackingWriters)) {
+        ValueToValueMapTy vmap;
+        clean = CloneFunction(&f, vmap);
+        clean->setName(f.getName() + ".sip.clean");
+        clean->setLinkage(GlobalValue::InternalLinkage);
+        clean->setComdat(nullptr);
+      }
+
+      FuncAnalyses fa = {fam.getResult<AAManager>(f),
+                         fam.getResult<DominatorTreeAnalysis>(f),
+                         fam.getResult<LoopAnalysis>(f),
+                         fam.getResult<ScalarEvolutionAnalysis>(f)};
+      if (analyseFunc(fa, nonPmem, pmem, f, rt, profile, report)) {
+        if (clean) {
+          addCleanDispatch(f, *clean, rt);
+          clonedCount++;
+        }
+        fam.invalidate(f, PreservedAnalyses::none());
+      } else if (clean) {
+        /* Nothing instrumented, the clone would be identical */
+        clean->eraseFromParent();
       }
     }
 
-    log((char *)"Instrumented %lu, skipped %lu locations (aliased=%lu, "
-                "exact=%lu).",
-        modCount, skipCount, aliasedLocationFound, exactLocationMatchFound);
-    return PreservedAnalyses::all();
+    /* The marks are only needed for the analysis, drop the calls */
+    const bool hadMarkers = m.getFunction(PmemMarkerStr) != nullptr;
+    PmemInfo::removeMarkers(m);
+    report.write();
+
+    log((char *)"Instrumented %lu stores, %lu memory intrinsics, %lu "
+                "atomics and %lu vector stores (%lu known PMEM), skipped %lu "
+                "locations "
+                "(aliased=%lu, exact=%lu, non-pmem=%lu, unmarked=%lu), "
+                "coalesced %lu loop stores, eliminated %lu redundant and "
+                "merged %lu adjacent, guarded %lu never-seen, cloned %lu "
+                "functions.",
+        modCount, memIntrinsicCount, atomicCount, vectorCount, knownPmemCount,
+        skipCount + nonPmemCount + unmarkedCount, aliasedLocationFound,
+        exactLocationMatchFound, nonPmemCount, unmarkedCount,
+        loopCoalescedCount, redundantCount, mergedCount, unprofiledCount,
+        clonedCount);
+
+    const bool modified =
+        modCount != 0 or loopCoalescedCount != 0 or unprofiledCount != 0 or
+        memIntrinsicCount != 0 or atomicCount != 0 or vectorCount != 0 or
+        hadMarkers;
+    return modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 };
 
@@ -199,6 +1781,20 @@ struct LegacyHelloWorld : public ModulePass {
 };
 } // namespace
 
+/** @brief Add the instrumentation and the analyses it needs to @p mpm */
+static void addInstrumentationPasses(ModulePassManager &mpm) {
+  /* Promote the locals to SSA values so that SCEV can see the induction
+     variables of the loops */
+  mpm.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+  mpm.addPass(createModuleToFunctionPassAdaptor(
+      RequireAnalysisPass<ScopedNoAliasAA, Function>()));
+  mpm.addPass(createModuleToFunctionPassAdaptor(
+      RequireAnalysisPass<TypeBasedAA, Function>()));
+  mpm.addPass(createModuleToFunctionPassAdaptor(
+      RequireAnalysisPass<BasicAA, Function>()));
+  mpm.addPass(HelloWorld(nullptr));
+}
+
 // New PM interface
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
@@ -207,13 +1803,19 @@ llvmGetPassPluginInfo() {
             PB.registerPipelineStartEPCallback(
                 [&](llvm::ModulePassManager &mpm,
                     llvm::PassBuilder::OptimizationLevel o) -> void {
-                  mpm.addPass(createModuleToFunctionPassAdaptor(
-                      RequireAnalysisPass<ScopedNoAliasAA, Function>()));
-                  mpm.addPass(createModuleToFunctionPassAdaptor(
-                      RequireAnalysisPass<TypeBasedAA, Function>()));
-                  mpm.addPass(createModuleToFunctionPassAdaptor(
-                      RequireAnalysisPass<BasicAA, Function>()));
-                  mpm.addPass(HelloWorld(nullptr));
+                  /* With DCLANG_LTO, dclang runs the pass by name in the
+                     linker's LTO pipeline instead, after cross-TU inlining */
+                  if (getenv("DCLANG_LTO") == nullptr) {
+                    addInstrumentationPasses(mpm);
+                  }
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &mpm,
+                   ArrayRef<PassBuilder::PipelineElement>) -> bool {
+                  if (name != "storeinst") return false;
+
+                  addInstrumentationPasses(mpm);
+                  return true;
                 });
           }};
 }
@@ -0,0 +1,68 @@
+// -*- mode: c++; c-basic-offset: 2; -*-
+
+/**
+ * @file   test_recovery.cc
+ * @date   octobre 17, 2026
+ * @brief  Test the order recovery replays redo logs in
+ */
+
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "log.hh"
+
+using nvsl::cxlbuf::Log;
+
+/** @brief Make @p buf a COMMITTED redo log holding one entry for
+ * [addr, addr+bytes) with every byte set to @p val */
+static Log::log_layout_t *make_redo_log(uint8_t *buf, uint64_t commit_seq,
+                                        uint8_t *addr, size_t bytes,
+                                        uint8_t val) {
+  auto *log = (Log::log_layout_t *)buf;
+
+  log->state =
+      Log::State(Log::COMMITTED | ((uint64_t)Log::CUR_FORMAT << 32));
+  log->mode = Log::MODE_REDO;
+  log->epoch = 1;
+  log->commit_seq = commit_seq;
+
+  uint8_t *entry = log->content;
+  const size_t hdr_sz = Log::entry_hdr_t::encode(entry, (uint64_t)addr, bytes);
+  std::memset(entry + hdr_sz, val, bytes);
+#ifdef LOG_CHECKSUM
+  Log::entry_hdr_t::seal(entry, entry + hdr_sz, log->epoch);
+#endif
+  log->log_offset = Log::entry_hdr_t::entry_size(bytes);
+
+  return log;
+}
+
+TEST(recovery, redo_commit_order) {
+  constexpr size_t LOG_SZ = 4096;
+  alignas(64) static uint8_t newer_buf[LOG_SZ], older_buf[LOG_SZ];
+  alignas(64) uint8_t mem[128] = {};
+
+  /* Slot 0 was committed last, both logs hold bytes [32, 64) of mem */
+  const auto *newer = make_redo_log(newer_buf, 2, mem, 64, 0xbb);
+  const auto *older = make_redo_log(older_buf, 1, mem + 32, 64, 0xaa);
+  const std::vector<const Log::log_layout_t *> logs = {newer, older};
+
+  ASSERT_TRUE(newer->needs_recovery(LOG_SZ));
+  ASSERT_TRUE(older->needs_recovery(LOG_SZ));
+
+  const auto order = Log::replay_order(logs);
+  ASSERT_EQ(order, (std::vector<size_t>{1, 0}));
+
+  for (const auto i : order) {
+    for (auto it = logs[i]->begin(); it != logs[i]->replay_end(LOG_SZ); ++it) {
+      const auto &entry = *it;
+      std::memcpy((void *)(uintptr_t)entry.addr, entry.content, entry.bytes);
+    }
+  }
+
+  for (size_t i = 0; i < 64; i++) ASSERT_EQ(mem[i], 0xbb) << "byte " << i;
+  for (size_t i = 64; i < 96; i++) ASSERT_EQ(mem[i], 0xaa) << "byte " << i;
+  for (size_t i = 96; i < 128; i++) ASSERT_EQ(mem[i], 0) << "byte " << i;
+}